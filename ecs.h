@@ -2,145 +2,4177 @@
 #define ECS_H
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(ECS_THREADS) // Opt-in, link with -pthread
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+#if defined(ECS_PROFILE) // Opt-in, compiled out otherwise
+#include <time.h>
+#endif
 
 #define inline inline __attribute__((always_inline)) // Force inlines
+#define ECS_COLD static __attribute__((noinline, unused)) // Slow paths stay out of line
+#if defined(__cplusplus) // C11 keywords by their C++ names
+#define ECS_ALIGNOF(type) alignof(type)
+#define ECS_STATIC_ASSERT(cond, msg) static_assert(cond, msg)
+#else
+#define ECS_ALIGNOF(type) _Alignof(type)
+#define ECS_STATIC_ASSERT(cond, msg) _Static_assert(cond, msg)
+#endif
 
 // Settings are tuned for performance.
-#define MAX_ENTS 1024 /* MAX 2048 */
-#define MAX_CMPS 32    /* MAX 64 */
-#define MAX_CMP_SIZE 8 /* MAX 64 */
+#ifndef MAX_ENTS
+#define MAX_ENTS 1024 /* Default capacity, worlds grow past it */
+#endif
+#ifndef MAX_CMPS
+#define MAX_CMPS 32    /* MAX ECS_MASK_BITS */
+#endif
+#ifndef ECS_MASK_BITS  /* Component mask width, 64, 128, 256 (-mavx2) or 512 (-mavx512f) */
+#if MAX_CMPS <= 64
+#define ECS_MASK_BITS 64
+#elif MAX_CMPS <= 128
+#define ECS_MASK_BITS 128
+#elif MAX_CMPS <= 256
+#define ECS_MASK_BITS 256
+#else
+#define ECS_MASK_BITS 512
+#endif
+#endif
+#ifndef MAX_CMP_SIZE
+#define MAX_CMP_SIZE 8 /* Slot size of unregistered components */
+#endif
+#ifndef ECS_INDEX_BITS
+#define ECS_INDEX_BITS 22 /* Entity index bits, the rest of ent_t is its generation */
+#endif
+#ifndef ECS_BATCH
+#define ECS_BATCH 256 /* Max entities per batch in table worlds */
+#endif
+#ifndef ECS_MAX_THREADS
+#define ECS_MAX_THREADS 64 /* Workers per pool and command buffers per set, MAX 256 */
+#endif
+#ifndef ECS_PAR_GRAIN
+#define ECS_PAR_GRAIN 1024 /* Entities per parallel work chunk */
+#endif
+#ifndef ECS_MAX_SYSTEMS
+#define ECS_MAX_SYSTEMS 64 /* Systems per schedule */
+#endif
+#ifndef ECS_BLOCK_SHIFT
+#define ECS_BLOCK_SHIFT 10 /* Entities per storage block (1 << shift), MIN 6 */
+#endif
+#ifndef ECS_POOL_SLAB_SHIFT
+#define ECS_POOL_SLAB_SHIFT 16 /* Bytes per pool slab (1 << shift), larger objects get a slab each */
+#endif
+#ifndef ECS_PROFILE_EVENTS
+#define ECS_PROFILE_EVENTS 65536 /* Trace events kept by a profile, ECS_PROFILE only */
+#endif
 
-typedef uint32_t ent_t;
+typedef uint32_t ent_t; // Index in the low ECS_INDEX_BITS, generation above
 typedef uint16_t cmp_t;
+#if ECS_MASK_BITS == 64
 typedef uint64_t cmps_t; // Component bitmask
+#else // GCC vector of 64-bit words, & | ^ ~ work as usual, 8 byte aligned so any struct can hold one
+typedef uint64_t cmps_t __attribute__((vector_size(ECS_MASK_BITS / 8), aligned(8))); // Past 128 bits, build with AVX
+#endif
+ECS_STATIC_ASSERT(MAX_CMPS <= ECS_MASK_BITS && ECS_MASK_BITS % 64 == 0 && (ECS_MASK_BITS & (ECS_MASK_BITS - 1)) == 0, "MAX_CMPS needs a wider ECS_MASK_BITS");
+#define ECS_MASK_WORDS (ECS_MASK_BITS / 64)
+
+// Entity handles
+#define ECS_INDEX_MASK ((ent_t)((1u << ECS_INDEX_BITS) - 1))
+#define ENT_INDEX(ent) ((size_t)((ent) & ECS_INDEX_MASK))
+#define ECS_GEN_MASK ((ent_t)-1 >> ECS_INDEX_BITS)
+#define ENT_GEN(ent) ((ent_t)(ent) >> ECS_INDEX_BITS)
+#define MAKE_ENT(index, gen) ((ent_t)(((ent_t)(gen) << ECS_INDEX_BITS) | (ent_t)(index)))
+#define ECS_DEAD UINT32_MAX
+#define ENT_PENDING(ent) (ENT_GEN(ent) == ECS_GEN_MASK) // Created through a command buffer, not flushed yet
+
+// World flags
+#define ECS_HUGE_PAGES (1u << 0) // Back blocks with 2MB pages, pair with a larger ECS_BLOCK_SHIFT
+#define ECS_ARCHETYPES (1u << 1) // Group entities by component set into chunks, set at init_ecs
+#define ECS_MAPPED     (1u << 2) // Blocks live in a file mapping, set by map_ecs, fixed capacity
+#define ECS_SNAPSHOTS  (1u << 3) // Blocks carry write epochs, set by the first snapshot_ecs
+#define ECS_FORKED     (1u << 4) // Blocks are borrowed from another world until first written, set by fork_ecs
+#define ECS_HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+// Blocked storage
+//// Every array in the world is a column of fixed-size blocks, so growing
+//// a world allocates new blocks and never moves the ones already in use.
+#define ECS_BLOCK_ENTS ((size_t)1 << ECS_BLOCK_SHIFT)
+#define ECS_BLOCK_MASK (ECS_BLOCK_ENTS - 1)
+
+typedef struct {
+    uint8_t** blocks;   // Block table, NULL until a block is first written
+    size_t block_count;
+    size_t stride;      // Bytes per element
+    size_t lane;        // Bytes per lane when split, a block keeps each lane of its elements as one array, else 0
+    uint32_t* epochs;   // Epoch of each block's last write, ECS_SNAPSHOTS and tick columns only
+    uint64_t* borrowed; // Bit per block still shared with the world this was forked from, ECS_FORKED only
+} ecs_col_t;
+
+#define ECS_AT(col, i) ((col)->blocks[(i) >> ECS_BLOCK_SHIFT] + ((i) & ECS_BLOCK_MASK) * (col)->stride)
+#define ECS_REF(type, col, i) (((type*)(col)->blocks[(i) >> ECS_BLOCK_SHIFT])[(i) & ECS_BLOCK_MASK])
+#define ECS_PITCH(col) ((col)->lane ? (col)->lane : (col)->stride) // Bytes from one element to the next, within a lane when split
+#define ECS_ROW(col, i) ((col)->blocks[(i) >> ECS_BLOCK_SHIFT] + ((i) & ECS_BLOCK_MASK) * ECS_PITCH(col)) // Element i, its first lane when split
+#define ECS_DIRTY(ecs, col, i) do { if ((col)->epochs) (col)->epochs[(i) >> ECS_BLOCK_SHIFT] = (ecs)->epoch; } while (0)
+#define ECS_BORROWED(col, b) ((col)->borrowed && ((col)->borrowed[(b) >> 6] >> ((b) & 63) & 1))
+#define ECS_OWN(ecs, col, i) (((ecs)->flags & ECS_FORKED) && ecs_col_touch((col), (i), (ecs)->flags)) // Before writing, nonzero on out of memory
+
+// Component flags
+#define ECS_CMP_SPARSE  (1u << 0) // Packed sparse set, iteration only touches entities that have it
+#define ECS_CMP_TRACKED (1u << 1) // Keep added and changed ticks per entity, see match_changed
+#define ECS_CMP_TAG     (1u << 2) // No data, only the mask bit, also set by registering size 0
+#define ECS_CMP_POOLED  (1u << 3) // Data lives in a per-component pool, the column holds a blob_t
+#define ECS_CMP_SPLIT   (1u << 4) // Each field (lane of `align` bytes) gets its own array per block, see VIEW_FIELD
+
+// Component layout
+typedef struct {
+    uint32_t size;  // Bytes copied by add_cmp
+    uint32_t align; // Power of two, stride is size rounded up to it
+    uint32_t flags;
+} cmp_info_t;
+
+// Ticks of a tracked component, indexed by entity, 0 is never
+typedef struct {
+    uint32_t added;
+    uint32_t changed; // Also set on add
+} ecs_tick_t;
+
+// Out-of-line component data, what a pooled component's column holds
+typedef struct {
+    uint32_t ref;  // Size class in the top bits, slot below
+    uint32_t size; // Bytes given to add_cmp or resize_cmp
+} blob_t;
+
+// Size classes of a pool, powers of two from 16 bytes
+#define ECS_POOL_CLASSES 27
+#define ECS_POOL_MIN_SHIFT 4
+#define ECS_POOL_SLOT_BITS 27
+#define ECS_POOL_SLOT_MASK ((1u << ECS_POOL_SLOT_BITS) - 1)
+#define ECS_POOL_MAX ((size_t)1 << (ECS_POOL_MIN_SHIFT + ECS_POOL_CLASSES - 1))
+
+// Slabs of one size class, freed slots are chained through their first bytes
+typedef struct {
+    uint32_t count;    // Slots carved so far
+    uint32_t head;     // First free slot + 1, 0 when none
+    size_t slab_count;
+    uint8_t** slabs;
+} ecs_pool_class_t;
+
+// Pool of one component, slabs never move so data pointers stay valid
+typedef struct {
+    ecs_pool_class_t classes[ECS_POOL_CLASSES];
+} ecs_pool_t;
+
+// Sparse set, data[cmp] is indexed by dense position instead of entity
+typedef struct {
+    size_t count;
+    ecs_col_t dense; // Packed entities (ent_t)
+    ecs_col_t index; // Entity -> dense position (uint32_t)
+} ecs_sparse_t;
+
+// Archetype, every entity with exactly `cmps` (sparse components aside)
+//// Rows live in chunks of ECS_BLOCK_ENTS, block b of every column points
+//// into chunk b, so one chunk holds all the components of its rows.
+typedef struct {
+    cmps_t cmps;
+    size_t count;
+    size_t chunk_count;
+    size_t chunk_bytes;
+    uint8_t** chunks;
+    ecs_col_t ents;           // Row -> entity (ent_t)
+    ecs_col_t cols[MAX_CMPS]; // Only the components in `cmps` have blocks
+    int32_t edges[MAX_CMPS];  // Archetype reached by toggling a component, -1 unknown
+} ecs_arch_t;
+
+// Entity slot, indexed by entity index
+typedef struct {
+    uint32_t gen; // Generation of the current (or next) handle
+    uint32_t pos; // Position in active_list, ECS_DEAD when free
+} ecs_slot_t;
+
+// Where an archetype entity lives
+typedef struct {
+    uint32_t arch;
+    uint32_t row;
+} ecs_rec_t;
+
+// Cached query, its matching set is kept current by every structural change
+typedef struct {
+    cmps_t cmps;
+    size_t count;
+    ecs_col_t ents;  // Packed matching entities (ent_t)
+    ecs_col_t index; // Entity -> position in ents (uint32_t)
+} query_t;
+
+#if defined(ECS_PROFILE)
+// Aggregates of one system, keyed by its function
+typedef struct {
+    const void* system;
+    const char* name;  // From name_system, NULL prints the address
+    const char* kind;  // Runner it was first seen in, run, batch, query, match or par
+    uint64_t calls;
+    uint64_t ns;
+    uint64_t max_ns;
+    uint64_t visited;  // Entities examined
+    uint64_t matched;  // Entities the system ran on
+    uint64_t changes;  // Structural changes while it ran, any thread
+} prof_sys_t;
+
+// One system run or frame mark, for trace export
+typedef struct {
+    uint32_t sys;      // Index in systems, UINT32_MAX for a frame mark
+    uint32_t tid;      // Worker running it
+    uint64_t start;    // Nanoseconds since init_prof
+    uint64_t ns;
+    uint64_t visited, matched;
+} prof_event_t;
+
+// Profile, attach with ecs->prof = &prof
+typedef struct {
+    size_t count;
+    size_t cap;
+    prof_sys_t* systems;
+    uint64_t creates, destroys, adds, dels; // Structural changes of attached worlds
+    uint64_t origin;                        // Clock at init_prof
+    uint64_t event_count;                   // Ever recorded, the last ECS_PROFILE_EVENTS are kept
+    prof_event_t* events;
+#if defined(ECS_THREADS)
+    pthread_mutex_t lock;                   // Systems in one wave finish concurrently
+#endif
+} prof_t;
+#endif
 
 // Structure of Arrays for performance
-typedef struct { 
-    size_t free_count; 
-    ent_t free_list[MAX_ENTS]; // List of free entity slots
+typedef struct {
+    uint32_t flags;
+    size_t capacity;          // Entity slots backed by blocks
+
+    size_t free_count;
+    ecs_col_t free_list;      // List of free entity slots (ent_t)
+
+    size_t active_count;
+    ecs_col_t active_list;    // List of active entities (ent_t)
+    ecs_col_t ent_slots;      // Generations and active positions (ecs_slot_t)
+
+    size_t ent_count;
+    ecs_col_t ent_cmps;       // List of entities (cmps_t)
+
+    cmp_info_t cmp_info[MAX_CMPS];
+    cmps_t sparse_cmps;             // Components stored as sparse sets
+    cmps_t tag_cmps;                // Components with no data, their columns never get blocks
+    cmps_t pooled_cmps;             // Components with ECS_CMP_POOLED
+    ecs_pool_t* pools[MAX_CMPS];    // Their data, NULL for the rest
+    ecs_sparse_t sparse[MAX_CMPS];
+    ecs_col_t data[MAX_CMPS];       // Raw Storage, one column per component
+    cmps_t tracked_cmps;            // Components with ECS_CMP_TRACKED
+    ecs_col_t ticks[MAX_CMPS];      // Entity -> ecs_tick_t, epochs hold each block's latest tick
+    uint32_t tick;                  // Ticks closed by tick_ecs, writes are stamped tick + 1
 
-    size_t active_count;      
-    ent_t active_list[MAX_ENTS]; // List of active entities
+    ecs_col_t ent_recs;             // Entity -> archetype row (ecs_rec_t), ECS_ARCHETYPES only
+    size_t arch_count;
+    size_t arch_cap;
+    ecs_arch_t* archs;
+    size_t arch_map_cap;
+    uint32_t* arch_map;             // Open addressed cmps -> archetype + 1
 
-    size_t ent_count; 
-    cmps_t ent_cmps[MAX_ENTS]; // List of entities (groups of components)
+    size_t query_count;
+    query_t** queries;
 
-    uint8_t data[MAX_CMPS][MAX_ENTS * MAX_CMP_SIZE]; // Raw Storage
+    uint8_t* map;                   // File mapping holding every block, ECS_MAPPED only
+    size_t map_len;
+
+    uint32_t epoch;                 // Stamped on written blocks, ECS_SNAPSHOTS only
+    const void* forked_from;        // World lending this one its blocks, ECS_FORKED only
+#if defined(ECS_PROFILE)
+    prof_t* prof;                   // Profile receiving this world's runs, NULL for none
+#endif
 } ecs_t;
 
 // System type
 typedef void (*system_t)(ecs_t*, ent_t, void*);
 
+// Batch of matching entities, element i of component c is at cols[c] + i * strides[c]
+typedef struct {
+    size_t count;
+    const ent_t* ents;
+    uint8_t* cols[MAX_CMPS];  // Only the requested components are set
+    size_t strides[MAX_CMPS];
+} view_t;
+
+// Batch system type, loops over the view itself
+typedef void (*batch_system_t)(ecs_t*, view_t*, void*);
+
+// Typed column of a view, valid when the component was registered with this type
+#define VIEW_CMP(view, type, cmp_id) ((type*)(view)->cols[cmp_id])
+// Typed array of one field of a split component across a view, for fields that fill one lane
+//   Lane k of a block starts k lanes of ECS_BLOCK_ENTS in, so a field's array is its offset scaled by the block
+#define VIEW_FIELD(view, type, cmp_id, field) ((__typeof__(((type*)0)->field)*)((view)->cols[cmp_id] + (offsetof(type, field) << ECS_BLOCK_SHIFT)))
+
+// Compacted list of matching entities, reusable across systems in a frame
+typedef struct {
+    cmps_t cmps;
+    size_t count;
+    size_t cap;
+    ent_t* ents;
+} match_t;
+
+// Batch iteration without a callback, what run_batch and EACH loop over
+typedef struct {
+    ecs_t* ecs;
+    cmps_t cmps;
+    uint32_t mode;         // Storage walked, ECS_EACH_*
+    cmp_t driver;          // Smallest sparse set of the mask
+    size_t arch;           // Current archetype
+    size_t next;           // Chunk, dense position or entity index looked at next
+    size_t visited, matched;
+    int stop;              // Set by a break out of EACH
+    int split;             // The mask holds a split component, EACH binds copies of those
+    ent_t cur;             // Entity whose split components EACH copied out
+    view_t view;           // Current batch
+    ent_t ents[ECS_BATCH]; // Its entities, table worlds
+} ecs_each_t;
+
 // Bitmask Macros
+#if ECS_MASK_BITS == 64
 #define   SET_BIT(mask, bit)  ((mask) |=  (1ULL << (bit)))
 #define CLEAR_BIT(mask, bit)  ((mask) &= ~(1ULL << (bit)))
 #define CHECK_BIT(mask, bit) (((mask) &   (1ULL << (bit))) != 0)
+#define ECS_BIT(bit)         ((cmps_t)1 << (bit))
+#define ANY_CMPS(mask)       ((mask) != 0)
+#define SAME_CMPS(a, b)      ((a) == (b))
+#define CHECK_CMPS(mask, cmps) (((mask) & (cmps)) == (cmps)) // Every component of cmps is in mask
+#define ECS_LOW_CMP(mask)    ((cmp_t)__builtin_ctzll(mask))
+#define ECS_POP_CMP(mask)    ((mask) &= (mask) - 1)
+#define ECS_COUNT_CMPS(mask) ((size_t)__builtin_popcountll(mask))
+#else
+#define   SET_BIT(mask, bit)  ((mask)[(bit) >> 6] |=  (1ULL << ((bit) & 63)))
+#define CLEAR_BIT(mask, bit)  ((mask)[(bit) >> 6] &= ~(1ULL << ((bit) & 63)))
+#define CHECK_BIT(mask, bit) ((((mask)[(bit) >> 6] >> ((bit) & 63)) & 1) != 0)
+#define ECS_BIT(bit)         ecs_mask_bit(bit)
+#define ANY_CMPS(mask)       ecs_mask_any(mask)
+#define SAME_CMPS(a, b)      (!ecs_mask_any((a) ^ (b)))
+#define CHECK_CMPS(mask, cmps) ecs_mask_has((mask), (cmps))
+#define ECS_LOW_CMP(mask)    ecs_mask_low(mask)
+#define ECS_POP_CMP(mask)    ecs_mask_pop(&(mask))
+#define ECS_COUNT_CMPS(mask) ecs_mask_count(mask)
+#endif
+#define ECS_NO_CMPS ((cmps_t){ 0 })
+// Iterate masks with `for (cmps_t m = mask; ANY_CMPS(m); ECS_POP_CMP(m)) { cmp_t c = ECS_LOW_CMP(m); }`
+
+#if ECS_MASK_BITS > 64
+// Wide masks
+static inline cmps_t ecs_mask_bit(size_t bit) {
+    cmps_t mask = ECS_NO_CMPS;
+    mask[bit >> 6] = 1ULL << (bit & 63);
+    return mask;
+}
+static inline int ecs_mask_any(cmps_t mask) {
+#if defined(__AVX__) && ECS_MASK_BITS >= 256
+    int none = 1;
+    for (size_t w = 0; w < ECS_MASK_WORDS; w += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)((const uint64_t*)&mask + w));
+        none &= _mm256_testz_si256(v, v);
+    }
+    return !none;
+#else
+    uint64_t any = 0;
+    for (size_t w = 0; w < ECS_MASK_WORDS; ++w) any |= mask[w];
+    return any != 0;
+#endif
+}
+//// Subset test, one vptest per 256 (or 128) bits
+static inline int ecs_mask_has(cmps_t mask, cmps_t cmps) {
+#if defined(__AVX__) && ECS_MASK_BITS >= 256
+    int has = 1;
+    for (size_t w = 0; w < ECS_MASK_WORDS; w += 4) { // Carry flag of vptest, (~mask & cmps) == 0
+        has &= _mm256_testc_si256(_mm256_loadu_si256((const __m256i*)((const uint64_t*)&mask + w)),
+                                  _mm256_loadu_si256((const __m256i*)((const uint64_t*)&cmps + w)));
+    }
+    return has;
+#elif defined(__SSE4_1__)
+    int has = 1;
+    for (size_t w = 0; w < ECS_MASK_WORDS; w += 2) {
+        has &= _mm_testc_si128(_mm_loadu_si128((const __m128i*)((const uint64_t*)&mask + w)),
+                               _mm_loadu_si128((const __m128i*)((const uint64_t*)&cmps + w)));
+    }
+    return has;
+#else
+    return !ecs_mask_any(cmps & ~mask);
+#endif
+}
+static inline cmp_t ecs_mask_low(cmps_t mask) {
+    size_t w = 0;
+    while (!mask[w]) ++w;
+    return (cmp_t)(w * 64 + (size_t)__builtin_ctzll(mask[w]));
+}
+static inline void ecs_mask_pop(cmps_t* mask) {
+    size_t w = 0;
+    while (!(*mask)[w]) ++w;
+    (*mask)[w] &= (*mask)[w] - 1;
+}
+static inline size_t ecs_mask_count(cmps_t mask) {
+    size_t count = 0;
+    for (size_t w = 0; w < ECS_MASK_WORDS; ++w) count += (size_t)__builtin_popcountll(mask[w]);
+    return count;
+}
+#endif
+//// Spread the bits of a mask, for hashing
+static inline size_t ecs_mask_hash(cmps_t mask) {
+#if ECS_MASK_BITS == 64
+    return (size_t)((mask * 0x9E3779B97F4A7C15ULL) >> 32);
+#else
+    uint64_t hash = 0;
+    for (size_t w = 0; w < ECS_MASK_WORDS; ++w) hash = (hash ^ mask[w]) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(hash >> 32);
+#endif
+}
+
+
+/* Memory */
+
+// Blocks
+//// Allocate a block, cache line aligned, or huge page backed when asked
+ECS_COLD uint8_t* ecs_block_alloc(size_t bytes, uint32_t flags) {
+#if defined(MAP_ANONYMOUS)
+    if (flags & ECS_HUGE_PAGES) {
+        size_t len = (bytes + ECS_HUGE_PAGE_SIZE - 1) & ~(ECS_HUGE_PAGE_SIZE - 1);
+        void* block = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+        block = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (block == MAP_FAILED) { // No reserved huge pages, ask for transparent ones
+            block = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (block == MAP_FAILED) return NULL;
+#if defined(MADV_HUGEPAGE)
+            madvise(block, len, MADV_HUGEPAGE);
+#endif
+        }
+        return (uint8_t*)block;
+    }
+#endif
+    (void)flags;
+    return (uint8_t*)aligned_alloc(64, (bytes + 63) & ~(size_t)63);
+}
+//// Free a block
+ECS_COLD void ecs_block_free(uint8_t* block, size_t bytes, uint32_t flags) {
+    if (!block) return;
+#if defined(MAP_ANONYMOUS)
+    if (flags & ECS_HUGE_PAGES) {
+        munmap(block, (bytes + ECS_HUGE_PAGE_SIZE - 1) & ~(ECS_HUGE_PAGE_SIZE - 1));
+        return;
+    }
+#endif
+    (void)bytes; (void)flags;
+    free(block);
+}
+
+// Columns
+//// Extend the block table, zero-filling new blocks when eager
+ECS_COLD int ecs_col_grow(ecs_col_t* col, size_t block_count, uint32_t flags, int eager) {
+    if (block_count <= col->block_count) return 0;
+
+    uint8_t** blocks = (uint8_t**)realloc(col->blocks, block_count * sizeof(uint8_t*));
+    if (!blocks) return -1;
+    col->blocks = blocks;
+    if ((flags & ECS_SNAPSHOTS) || col->epochs) { // Tick columns keep theirs regardless
+        uint32_t* epochs = (uint32_t*)realloc(col->epochs, block_count * sizeof(uint32_t));
+        if (!epochs) return -1;
+        memset(epochs + col->block_count, 0, (block_count - col->block_count) * sizeof(uint32_t));
+        col->epochs = epochs;
+    }
+    if (col->borrowed) { // New blocks are never borrowed
+        size_t words = (col->block_count + 63) >> 6, grown = (block_count + 63) >> 6;
+        uint64_t* borrowed = (uint64_t*)realloc(col->borrowed, grown * sizeof(uint64_t));
+        if (!borrowed) return -1;
+        memset(borrowed + words, 0, (grown - words) * sizeof(uint64_t));
+        col->borrowed = borrowed;
+    }
+
+    for (size_t b = col->block_count; b < block_count; ++b) {
+        blocks[b] = NULL;
+        if (eager) {
+            if (!(blocks[b] = ecs_block_alloc(col->stride << ECS_BLOCK_SHIFT, flags))) return -1;
+            memset(blocks[b], 0, col->stride << ECS_BLOCK_SHIFT);
+        }
+        col->block_count = b + 1;
+    }
+    return 0;
+}
+//// Release every block of a column, borrowed ones stay with their owner
+ECS_COLD void ecs_col_free(ecs_col_t* col, uint32_t flags) {
+    for (size_t b = 0; b < col->block_count; ++b) {
+        if (!ECS_BORROWED(col, b)) ecs_block_free(col->blocks[b], col->stride << ECS_BLOCK_SHIFT, flags);
+    }
+    free(col->blocks);
+    free(col->epochs);
+    free(col->borrowed);
+    col->blocks = NULL;
+    col->epochs = NULL;
+    col->borrowed = NULL;
+    col->block_count = 0;
+}
+//// Contiguous bytes of an element from `offset` on, the rest of its lane when split
+static inline size_t ecs_col_span(const ecs_col_t* col, size_t offset) {
+    return col->lane ? col->lane - (offset & (col->lane - 1)) : col->stride - offset;
+}
+//// Byte `offset` of element i, wherever its lane lives
+static inline uint8_t* ecs_col_byte(ecs_col_t* col, size_t i, size_t offset) {
+    if (!col->lane) return ECS_AT(col, i) + offset;
+    return ECS_ROW(col, i) + (offset & ~(col->lane - 1)) * ECS_BLOCK_ENTS + (offset & (col->lane - 1));
+}
+//// Copy `size` bytes at `offset` of element i in, a lane at a time when split
+static inline void ecs_col_write(ecs_col_t* col, size_t i, size_t offset, const void* data, size_t size) {
+    for (size_t k = 0, n; k < size; k += n) {
+        n = ecs_col_span(col, offset + k) < size - k ? ecs_col_span(col, offset + k) : size - k;
+        memcpy(ecs_col_byte(col, i, offset + k), (const uint8_t*)data + k, n);
+    }
+}
+//// Copy `size` bytes at `offset` of element i out
+static inline void ecs_col_read(ecs_col_t* col, size_t i, size_t offset, void* out, size_t size) {
+    for (size_t k = 0, n; k < size; k += n) {
+        n = ecs_col_span(col, offset + k) < size - k ? ecs_col_span(col, offset + k) : size - k;
+        memcpy((uint8_t*)out + k, ecs_col_byte(col, i, offset + k), n);
+    }
+}
+//// Copy element `from` of src over element `to` of dst, both laid out alike
+static inline void ecs_col_copy(ecs_col_t* dst, size_t to, ecs_col_t* src, size_t from) {
+    if (!dst->lane) { memcpy(ECS_AT(dst, to), ECS_AT(src, from), dst->stride); return; }
+    for (size_t k = 0; k < dst->stride; k += dst->lane) memcpy(ecs_col_byte(dst, to, k), ecs_col_byte(src, from, k), dst->lane);
+}
+//// Exchange elements i and j of a column, a lane at a time when split
+static inline void ecs_col_swap(ecs_col_t* col, size_t i, size_t j) {
+    uint8_t tmp[64];
+    for (size_t k = 0, n; k < col->stride; k += n) {
+        n = ecs_col_span(col, k) < sizeof(tmp) ? ecs_col_span(col, k) : sizeof(tmp);
+        memcpy(tmp, ecs_col_byte(col, i, k), n);
+        memcpy(ecs_col_byte(col, i, k), ecs_col_byte(col, j, k), n);
+        memcpy(ecs_col_byte(col, j, k), tmp, n);
+    }
+}
+//// Replace a borrowed block with a copy of it
+ECS_COLD int ecs_col_own(ecs_col_t* col, size_t b, uint32_t flags) {
+    uint8_t* copy = ecs_block_alloc(col->stride << ECS_BLOCK_SHIFT, flags);
+    if (!copy) return -1;
+    memcpy(copy, col->blocks[b], col->stride << ECS_BLOCK_SHIFT);
+    col->blocks[b] = copy;
+    col->borrowed[b >> 6] &= ~(1ULL << (b & 63));
+    return 0;
+}
+
+// World
+//// Grow to hold at least `capacity` entities, one block at a time
+ECS_COLD int ecs_grow(ecs_t* ecs, size_t capacity) {
+    size_t blocks = (capacity + ECS_BLOCK_MASK) >> ECS_BLOCK_SHIFT;
+    if (!ecs->ent_cmps.stride) { // Zero-initialized world
+        ecs->free_list.stride   = sizeof(ent_t);
+        ecs->active_list.stride = sizeof(ent_t);
+        ecs->ent_slots.stride   = sizeof(ecs_slot_t);
+        ecs->ent_cmps.stride    = sizeof(cmps_t);
+        ecs->ent_recs.stride    = sizeof(ecs_rec_t);
+        for (size_t c = 0; c < MAX_CMPS; ++c) {
+            ecs->cmp_info[c] = (cmp_info_t){ MAX_CMP_SIZE, (MAX_CMP_SIZE & -MAX_CMP_SIZE) < 64 ? (MAX_CMP_SIZE & -MAX_CMP_SIZE) : 64, 0 };
+            ecs->data[c].stride = MAX_CMP_SIZE;
+            ecs->sparse[c].dense.stride = sizeof(ent_t);
+            ecs->sparse[c].index.stride = sizeof(uint32_t);
+            ecs->ticks[c].stride = sizeof(ecs_tick_t);
+        }
+    }
+    if ((ecs->flags & ECS_MAPPED) && blocks > ecs->capacity >> ECS_BLOCK_SHIFT) return -1; // The file is fixed size
+
+    if (ecs_col_grow(&ecs->free_list,   blocks, ecs->flags, 1) ||
+        ecs_col_grow(&ecs->active_list, blocks, ecs->flags, 1) ||
+        ecs_col_grow(&ecs->ent_slots,   blocks, ecs->flags, 1) ||
+        ecs_col_grow(&ecs->ent_cmps,    blocks, ecs->flags, 1)) return -1;
+    if ((ecs->flags & ECS_ARCHETYPES) && ecs_col_grow(&ecs->ent_recs, blocks, ecs->flags, 1)) return -1;
+    for (size_t c = 0; c < MAX_CMPS; ++c) { // Component blocks are allocated on first add
+        if (ecs_col_grow(&ecs->data[c], blocks, ecs->flags, 0) ||
+            ecs_col_grow(&ecs->sparse[c].dense, blocks, ecs->flags, 0) ||
+            ecs_col_grow(&ecs->sparse[c].index, blocks, ecs->flags, 0) ||
+            ecs_col_grow(&ecs->ticks[c], blocks, ecs->flags, 0)) return -1;
+    }
+    for (size_t q = 0; q < ecs->query_count; ++q) {
+        if (ecs_col_grow(&ecs->queries[q]->ents, blocks, ecs->flags, 0) ||
+            ecs_col_grow(&ecs->queries[q]->index, blocks, ecs->flags, 0)) return -1;
+    }
+    if (ecs->capacity < blocks << ECS_BLOCK_SHIFT) ecs->capacity = blocks << ECS_BLOCK_SHIFT;
+    return 0;
+}
+ECS_COLD int32_t ecs_arch_get(ecs_t* ecs, cmps_t cmps);
+//// Init a world, a zeroed ecs_t is also valid and grows on first use
+ECS_COLD int init_ecs(ecs_t* ecs, size_t capacity, uint32_t flags) {
+    memset(ecs, 0, sizeof(ecs_t));
+    ecs->flags = flags;
+    if (ecs_grow(ecs, capacity ? capacity : MAX_ENTS)) return -1;
+    return (flags & ECS_ARCHETYPES) && ecs_arch_get(ecs, ECS_NO_CMPS) < 0 ? -1 : 0; // New entities start empty
+}
+//// Release everything a world owns
+ECS_COLD void ecs_map_close(ecs_t* ecs);
+ECS_COLD void ecs_pool_free_all(ecs_pool_t* pool);
+ECS_COLD void deinit_ecs(ecs_t* ecs) {
+    if (ecs->flags & ECS_MAPPED) ecs_map_close(ecs);
+    for (size_t q = 0; q < ecs->query_count; ++q) {
+        ecs_col_free(&ecs->queries[q]->ents, ecs->flags);
+        ecs_col_free(&ecs->queries[q]->index, ecs->flags);
+        free(ecs->queries[q]);
+    }
+    free(ecs->queries);
+    for (size_t a = 0; a < ecs->arch_count; ++a) {
+        ecs_arch_t* arch = &ecs->archs[a];
+        for (size_t k = 0; k < arch->chunk_count; ++k) ecs_block_free(arch->chunks[k], arch->chunk_bytes, ecs->flags);
+        free(arch->chunks);
+        free(arch->ents.blocks);
+        for (size_t c = 0; c < MAX_CMPS; ++c) free(arch->cols[c].blocks);
+    }
+    free(ecs->archs);
+    free(ecs->arch_map);
+    ecs_col_free(&ecs->ent_recs, ecs->flags);
+    ecs_col_free(&ecs->free_list, ecs->flags);
+    ecs_col_free(&ecs->active_list, ecs->flags);
+    ecs_col_free(&ecs->ent_slots, ecs->flags);
+    ecs_col_free(&ecs->ent_cmps, ecs->flags);
+    for (size_t c = 0; c < MAX_CMPS; ++c) {
+        ecs_col_free(&ecs->data[c], ecs->flags);
+        ecs_col_free(&ecs->sparse[c].dense, ecs->flags);
+        ecs_col_free(&ecs->sparse[c].index, ecs->flags);
+        ecs_col_free(&ecs->ticks[c], ecs->flags);
+        ecs_pool_free_all(ecs->pools[c]);
+    }
+    memset(ecs, 0, sizeof(ecs_t));
+}
+//// Heap allocated world
+ECS_COLD ecs_t* malloc_ecs(size_t capacity, uint32_t flags) {
+    ecs_t* ecs = (ecs_t*)malloc(sizeof(ecs_t));
+    if (ecs && init_ecs(ecs, capacity, flags)) {
+        deinit_ecs(ecs);
+        free(ecs);
+        return NULL;
+    }
+    return ecs;
+}
+//// Free a heap allocated world
+ECS_COLD void free_ecs(ecs_t* ecs) {
+    if (!ecs) return;
+    deinit_ecs(ecs);
+    free(ecs);
+}
+
+
+// Components
+//// Register a component's real size, alignment and storage, before any entity has it
+////   Size 0 (or ECS_CMP_TAG) makes a tag: only its mask bit is stored and
+////   get_cmp returns NULL for it. ECS_CMP_POOLED keeps the data out of line,
+////   each entity's add_cmp may then pass any size up to ECS_POOL_MAX.
+////   ECS_CMP_SPLIT stores every `align`-byte field in its own array per block,
+////   reach it with get_field/GET_FIELD or VIEW_FIELD, get_cmp sees the first only.
+ECS_COLD int register_cmp(ecs_t* ecs, cmp_t cmp_id, size_t size, size_t align, uint32_t flags) {
+    if (cmp_id >= MAX_CMPS || !align || (align & (align - 1)) || align > 64) return -1;
+    if (!ecs->ent_cmps.stride && ecs_grow(ecs, 0)) return -1;
+    if (!size || (flags & ECS_CMP_TAG)) { size = 0; flags |= ECS_CMP_TAG; }
+    if ((flags & ECS_CMP_POOLED) && ((flags & ECS_CMP_TAG) || (ecs->flags & ECS_FORKED))) return -1;
+    if ((flags & ECS_CMP_SPLIT) && (flags & (ECS_CMP_TAG | ECS_CMP_POOLED))) return -1;
+
+    ecs_col_t* col = &ecs->data[cmp_id];
+    for (size_t b = 0; b < col->block_count; ++b) {
+        if (col->blocks[b]) return -1; // Column already holds data
+    }
+    for (size_t a = 0; a < ecs->arch_count; ++a) {
+        if (CHECK_BIT(ecs->archs[a].cmps, cmp_id)) return -1;
+    }
+    for (size_t i = 0; CHECK_BIT(ecs->tag_cmps, cmp_id) && i < ecs->ent_count; ++i) {
+        if (CHECK_BIT(ECS_REF(cmps_t, &ecs->ent_cmps, i), cmp_id)) return -1; // Tags leave no data to find
+    }
+    if ((flags & ECS_CMP_POOLED) && !ecs->pools[cmp_id] && !(ecs->pools[cmp_id] = (ecs_pool_t*)calloc(1, sizeof(ecs_pool_t)))) return -1;
+    if (!(flags & ECS_CMP_POOLED)) { ecs_pool_free_all(ecs->pools[cmp_id]); ecs->pools[cmp_id] = NULL; }
+    ecs->cmp_info[cmp_id] = (cmp_info_t){ (uint32_t)size, (uint32_t)align, flags };
+    col->stride = (flags & ECS_CMP_POOLED) ? sizeof(blob_t) : (size + align - 1) & ~(align - 1);
+    col->lane = (flags & ECS_CMP_SPLIT) ? align : 0;
+    if (flags & ECS_CMP_POOLED) SET_BIT(ecs->pooled_cmps, cmp_id);
+    else                      CLEAR_BIT(ecs->pooled_cmps, cmp_id);
+    if (flags & ECS_CMP_SPARSE) SET_BIT(ecs->sparse_cmps, cmp_id);
+    else                      CLEAR_BIT(ecs->sparse_cmps, cmp_id);
+    if (flags & ECS_CMP_TAG) SET_BIT(ecs->tag_cmps, cmp_id);
+    else                   CLEAR_BIT(ecs->tag_cmps, cmp_id);
+    CLEAR_BIT(ecs->tracked_cmps, cmp_id);
+    if (flags & ECS_CMP_TRACKED) {
+        ecs_col_t* ticks = &ecs->ticks[cmp_id];
+        if (!ticks->epochs && !(ticks->epochs = (uint32_t*)calloc(ticks->block_count ? ticks->block_count : 1, sizeof(uint32_t)))) return -1;
+        SET_BIT(ecs->tracked_cmps, cmp_id);
+    }
+    return 0;
+}
+#define REGISTER_CMP(ecs, cmp_id, type, flags) register_cmp((ecs), (cmp_id), sizeof(type), ECS_ALIGNOF(type), (flags))
+#define REGISTER_TAG(ecs, cmp_id, flags) register_cmp((ecs), (cmp_id), 0, 1, (flags))
+
+// Sparse sets
+//// Ensure the block holding element `i` exists and is this world's, tag columns never get one
+static inline int ecs_col_touch(ecs_col_t* col, size_t i, uint32_t flags) {
+    if ((flags & ECS_FORKED) && ECS_BORROWED(col, i >> ECS_BLOCK_SHIFT)) return ecs_col_own(col, i >> ECS_BLOCK_SHIFT, flags);
+    uint8_t** block = &col->blocks[i >> ECS_BLOCK_SHIFT];
+    return (*block || !col->stride || (*block = ecs_block_alloc(col->stride << ECS_BLOCK_SHIFT, flags))) ? 0 : -1;
+}
+//// Append an entity, returns its dense position
+static inline int ecs_sparse_add(ecs_t* ecs, ecs_sparse_t* set, ecs_col_t* col, ent_t ent) {
+    size_t pos = set->count;
+    if (ecs_col_touch(&set->dense, pos, ecs->flags) || ecs_col_touch(col, pos, ecs->flags) ||
+        ecs_col_touch(&set->index, ENT_INDEX(ent), ecs->flags)) return -1;
+    ECS_REF(ent_t, &set->dense, pos) = ent;
+    ECS_REF(uint32_t, &set->index, ENT_INDEX(ent)) = (uint32_t)pos;
+    ECS_DIRTY(ecs, &set->dense, pos);
+    ECS_DIRTY(ecs, &set->index, ENT_INDEX(ent));
+    set->count++;
+    return (int)pos;
+}
+//// Own every block ecs_sparse_del writes, forks only
+static inline int ecs_sparse_own(ecs_t* ecs, ecs_sparse_t* set, ecs_col_t* col, ent_t ent) {
+    if (!(ecs->flags & ECS_FORKED)) return 0;
+    uint32_t pos = ECS_REF(uint32_t, &set->index, ENT_INDEX(ent));
+    ent_t moved = ECS_REF(ent_t, &set->dense, set->count - 1);
+    return ecs_col_touch(col, pos, ecs->flags) || ecs_col_touch(&set->dense, pos, ecs->flags) ||
+           ecs_col_touch(&set->index, ENT_INDEX(moved), ecs->flags) ? -1 : 0;
+}
+//// Swap-remove an entity, the last element fills its hole
+static inline void ecs_sparse_del(ecs_t* ecs, ecs_sparse_t* set, ecs_col_t* col, ent_t ent) {
+    uint32_t pos = ECS_REF(uint32_t, &set->index, ENT_INDEX(ent));
+    size_t last = --set->count;
+    if (pos != last) {
+        ent_t moved = ECS_REF(ent_t, &set->dense, last);
+        if (col->stride) ecs_col_copy(col, pos, col, last);
+        ECS_REF(ent_t, &set->dense, pos) = moved;
+        ECS_REF(uint32_t, &set->index, ENT_INDEX(moved)) = pos;
+        ECS_DIRTY(ecs, col, pos);
+        ECS_DIRTY(ecs, &set->dense, pos);
+        ECS_DIRTY(ecs, &set->index, ENT_INDEX(moved));
+    }
+}
+
+// Pools
+//// Size class holding `size` bytes at `align`, smallest power of two from 16
+static inline uint32_t ecs_pool_class(size_t size, size_t align) {
+    if (size < align) size = align;
+    return size <= ((size_t)1 << ECS_POOL_MIN_SHIFT) ? 0 : (uint32_t)(64 - __builtin_clzll((uint64_t)size - 1)) - ECS_POOL_MIN_SHIFT;
+}
+//// Slots per slab of a class as a shift, large classes get one slot per slab
+static inline uint32_t ecs_pool_per_slab(uint32_t k) {
+    return ECS_POOL_MIN_SHIFT + k < ECS_POOL_SLAB_SHIFT ? ECS_POOL_SLAB_SHIFT - ECS_POOL_MIN_SHIFT - k : 0;
+}
+//// Data of a pool reference
+static inline uint8_t* ecs_pool_at(ecs_pool_t* pool, uint32_t ref) {
+    uint32_t k = ref >> ECS_POOL_SLOT_BITS, slot = ref & ECS_POOL_SLOT_MASK, per = ecs_pool_per_slab(k);
+    return pool->classes[k].slabs[slot >> per] + ((size_t)(slot & ((1u << per) - 1)) << (ECS_POOL_MIN_SHIFT + k));
+}
+//// Add a slab to a class
+ECS_COLD int ecs_pool_grow(ecs_pool_class_t* cls, uint32_t k) {
+    uint8_t** slabs = (uint8_t**)realloc(cls->slabs, (cls->slab_count + 1) * sizeof(uint8_t*));
+    if (!slabs) return -1;
+    cls->slabs = slabs;
+    if (!(slabs[cls->slab_count] = ecs_block_alloc((size_t)1 << (ECS_POOL_MIN_SHIFT + k + ecs_pool_per_slab(k)), 0))) return -1;
+    cls->slab_count++;
+    return 0;
+}
+//// Make sure class k has a slot for the next ecs_pool_take, the only step that can fail
+static inline int ecs_pool_reserve(ecs_pool_t* pool, uint32_t k) {
+    ecs_pool_class_t* cls = &pool->classes[k];
+    if (cls->head || cls->count < (cls->slab_count << ecs_pool_per_slab(k))) return 0;
+    return cls->count > ECS_POOL_SLOT_MASK ? -1 : ecs_pool_grow(cls, k);
+}
+//// Take a reserved slot of class k, freed slots first
+static inline uint32_t ecs_pool_take(ecs_pool_t* pool, uint32_t k) {
+    ecs_pool_class_t* cls = &pool->classes[k];
+    uint32_t ref = (k << ECS_POOL_SLOT_BITS);
+    if (!cls->head) return ref | cls->count++;
+    ref |= cls->head - 1;
+    memcpy(&cls->head, ecs_pool_at(pool, ref), sizeof(uint32_t));
+    return ref;
+}
+//// Return a slot to its class
+static inline void ecs_pool_free(ecs_pool_t* pool, uint32_t ref) {
+    ecs_pool_class_t* cls = &pool->classes[ref >> ECS_POOL_SLOT_BITS];
+    memcpy(ecs_pool_at(pool, ref), &cls->head, sizeof(uint32_t));
+    cls->head = (ref & ECS_POOL_SLOT_MASK) + 1;
+}
+//// Release every slab of a pool at once
+ECS_COLD void ecs_pool_free_all(ecs_pool_t* pool) {
+    if (!pool) return;
+    for (uint32_t k = 0; k < ECS_POOL_CLASSES; ++k) {
+        ecs_pool_class_t* cls = &pool->classes[k];
+        for (size_t b = 0; b < cls->slab_count; ++b) ecs_block_free(cls->slabs[b], (size_t)1 << (ECS_POOL_MIN_SHIFT + k + ecs_pool_per_slab(k)), 0);
+        free(cls->slabs);
+    }
+    free(pool);
+}
+//// Store `size` bytes in a reserved slot and point a blob at them
+static inline void ecs_blob_set(ecs_t* ecs, cmp_t cmp_id, blob_t* blob, const void* data, size_t size) {
+    ecs_pool_t* pool = ecs->pools[cmp_id];
+    blob->ref = ecs_pool_take(pool, ecs_pool_class(size, ecs->cmp_info[cmp_id].align));
+    blob->size = (uint32_t)size;
+    if (data) memcpy(ecs_pool_at(pool, blob->ref), data, size);
+}
+
+// Queries
+//// Make room for an entity entering queries, the only step of a sync that can fail
+////   Runs before the structural change, so out of memory changes nothing. `ahead`
+////   counts entities of the same change reserved before this one.
+static inline int ecs_queries_reserve(ecs_t* ecs, ent_t ent, size_t ahead, int had, cmps_t old, cmps_t now) {
+    for (size_t q = 0; q < ecs->query_count; ++q) {
+        query_t* query = ecs->queries[q];
+        if (!CHECK_CMPS(now, query->cmps) || (had && CHECK_CMPS(old, query->cmps))) continue;
+        if (ecs_col_touch(&query->ents, query->count + ahead, ecs->flags) ||
+            ecs_col_touch(&query->index, ENT_INDEX(ent), ecs->flags)) return -1;
+    }
+    return 0;
+}
+//// Keep every query's set current across one entity's change, `had`/`has` are liveness
+////   Entering entities need ecs_queries_reserve first.
+static inline void ecs_queries_sync(ecs_t* ecs, ent_t ent, int had, cmps_t old, int has, cmps_t now) {
+    for (size_t q = 0; q < ecs->query_count; ++q) {
+        query_t* query = ecs->queries[q];
+        int was = had && CHECK_CMPS(old, query->cmps);
+        int is  = has && CHECK_CMPS(now, query->cmps);
+        if (was == is) continue;
+        if (is) {
+            ECS_REF(ent_t, &query->ents, query->count) = ent;
+            ECS_REF(uint32_t, &query->index, ENT_INDEX(ent)) = (uint32_t)query->count;
+            query->count++;
+        } else { // Swap-remove
+            uint32_t pos = ECS_REF(uint32_t, &query->index, ENT_INDEX(ent));
+            ent_t moved = ECS_REF(ent_t, &query->ents, query->count - 1);
+            query->count--;
+            ECS_REF(ent_t, &query->ents, pos) = moved;
+            ECS_REF(uint32_t, &query->index, ENT_INDEX(moved)) = pos;
+        }
+    }
+}
+
+// Archetypes
+//// Hash slot of a component set
+static inline size_t ecs_arch_slot(ecs_t* ecs, cmps_t cmps) {
+    size_t slot = ecs_mask_hash(cmps) & (ecs->arch_map_cap - 1);
+    while (ecs->arch_map[slot] && !SAME_CMPS(ecs->archs[ecs->arch_map[slot] - 1].cmps, cmps)) {
+        slot = (slot + 1) & (ecs->arch_map_cap - 1);
+    }
+    return slot;
+}
+//// Find or create the archetype of a component set
+ECS_COLD int32_t ecs_arch_get(ecs_t* ecs, cmps_t cmps) {
+    cmps &= ~ecs->sparse_cmps; // Sparse components never split archetypes
+    if (ecs->arch_map_cap) {
+        uint32_t found = ecs->arch_map[ecs_arch_slot(ecs, cmps)];
+        if (found) return (int32_t)found - 1;
+    }
+
+    if (ecs->arch_count == ecs->arch_cap) {
+        size_t cap = ecs->arch_cap ? ecs->arch_cap * 2 : 16;
+        ecs_arch_t* archs = (ecs_arch_t*)realloc(ecs->archs, cap * sizeof(ecs_arch_t));
+        if (!archs) return -1;
+        ecs->archs = archs;
+        ecs->arch_cap = cap;
+    }
+    if ((ecs->arch_count + 1) * 2 > ecs->arch_map_cap) { // Rehash at half load
+        size_t cap = ecs->arch_map_cap ? ecs->arch_map_cap * 2 : 32;
+        uint32_t* map = (uint32_t*)calloc(cap, sizeof(uint32_t));
+        if (!map) return -1;
+        free(ecs->arch_map);
+        ecs->arch_map = map;
+        ecs->arch_map_cap = cap;
+        for (size_t a = 0; a < ecs->arch_count; ++a) map[ecs_arch_slot(ecs, ecs->archs[a].cmps)] = (uint32_t)a + 1;
+    }
+
+    ecs_arch_t* arch = &ecs->archs[ecs->arch_count];
+    memset(arch, 0, sizeof(ecs_arch_t));
+    arch->cmps = cmps;
+    arch->ents.stride = sizeof(ent_t);
+    arch->chunk_bytes = ((sizeof(ent_t) << ECS_BLOCK_SHIFT) + 63) & ~(size_t)63;
+    for (size_t c = 0; c < MAX_CMPS; ++c) {
+        arch->edges[c] = -1;
+        if (!CHECK_BIT(cmps, c)) continue;
+        arch->cols[c].stride = ecs->data[c].stride;
+        arch->cols[c].lane = ecs->data[c].lane;
+        arch->chunk_bytes += ((ecs->data[c].stride << ECS_BLOCK_SHIFT) + 63) & ~(size_t)63;
+    }
+    ecs->arch_map[ecs_arch_slot(ecs, cmps)] = (uint32_t)ecs->arch_count + 1;
+    return (int32_t)ecs->arch_count++;
+}
+//// Archetype reached by toggling one component, cached on the edge
+static inline int32_t ecs_arch_edge(ecs_t* ecs, uint32_t from, cmp_t cmp_id) {
+    int32_t to = ecs->archs[from].edges[cmp_id];
+    if (to < 0 && (to = ecs_arch_get(ecs, ecs->archs[from].cmps ^ ECS_BIT(cmp_id))) >= 0) {
+        ecs->archs[from].edges[cmp_id] = to;
+    }
+    return to;
+}
+//// Carve a new chunk into the block tables of every column
+ECS_COLD int ecs_arch_chunk(ecs_t* ecs, ecs_arch_t* arch) {
+    size_t k = arch->chunk_count;
+    uint8_t** chunks = (uint8_t**)realloc(arch->chunks, (k + 1) * sizeof(uint8_t*));
+    if (!chunks) return -1;
+    arch->chunks = chunks;
+    uint8_t** ents = (uint8_t**)realloc(arch->ents.blocks, (k + 1) * sizeof(uint8_t*));
+    if (!ents) return -1;
+    arch->ents.blocks = ents;
+    for (size_t c = 0; c < MAX_CMPS; ++c) {
+        if (!CHECK_BIT(arch->cmps, c)) continue;
+        uint8_t** blocks = (uint8_t**)realloc(arch->cols[c].blocks, (k + 1) * sizeof(uint8_t*));
+        if (!blocks) return -1;
+        arch->cols[c].blocks = blocks;
+    }
+
+    uint8_t* chunk = ecs_block_alloc(arch->chunk_bytes, ecs->flags);
+    if (!chunk) return -1;
+    chunks[k] = chunk;
+    ents[k] = chunk;
+    size_t offset = ((sizeof(ent_t) << ECS_BLOCK_SHIFT) + 63) & ~(size_t)63;
+    for (size_t c = 0; c < MAX_CMPS; ++c) {
+        if (!CHECK_BIT(arch->cmps, c)) continue;
+        arch->cols[c].blocks[k] = arch->cols[c].stride ? chunk + offset : NULL; // Tags read as NULL
+        arch->cols[c].block_count = k + 1;
+        offset += ((arch->cols[c].stride << ECS_BLOCK_SHIFT) + 63) & ~(size_t)63;
+    }
+    arch->ents.block_count = k + 1;
+    arch->chunk_count = k + 1;
+    return 0;
+}
+//// Append an entity, returns its row
+static inline int ecs_arch_push(ecs_t* ecs, uint32_t a, ent_t ent) {
+    ecs_arch_t* arch = &ecs->archs[a];
+    if (arch->count == arch->chunk_count << ECS_BLOCK_SHIFT && ecs_arch_chunk(ecs, arch)) return -1;
+    size_t row = arch->count++;
+    ECS_REF(ent_t, &arch->ents, row) = ent;
+    ECS_REF(ecs_rec_t, &ecs->ent_recs, ENT_INDEX(ent)) = (ecs_rec_t){ a, (uint32_t)row };
+    return (int)row;
+}
+//// Swap-remove a row, the last row fills its hole
+static inline void ecs_arch_pop(ecs_t* ecs, uint32_t a, size_t row) {
+    ecs_arch_t* arch = &ecs->archs[a];
+    size_t last = --arch->count;
+    if (row == last) return;
+    for (cmps_t cmps = arch->cmps & ~ecs->tag_cmps; ANY_CMPS(cmps); ECS_POP_CMP(cmps)) {
+        ecs_col_t* col = &arch->cols[ECS_LOW_CMP(cmps)];
+        ecs_col_copy(col, row, col, last);
+    }
+    ent_t moved = ECS_REF(ent_t, &arch->ents, last);
+    ECS_REF(ent_t, &arch->ents, row) = moved;
+    ECS_REF(ecs_rec_t, &ecs->ent_recs, ENT_INDEX(moved)).row = (uint32_t)row;
+}
+//// Move an entity to another archetype, carrying the components both share
+static inline int ecs_arch_move(ecs_t* ecs, ent_t ent, uint32_t to) {
+    ecs_rec_t from = ECS_REF(ecs_rec_t, &ecs->ent_recs, ENT_INDEX(ent));
+    int row = ecs_arch_push(ecs, to, ent);
+    if (row < 0) return -1;
+    ecs_arch_t* src = &ecs->archs[from.arch];
+    ecs_arch_t* dst = &ecs->archs[to];
+    for (cmps_t cmps = src->cmps & dst->cmps & ~ecs->tag_cmps; ANY_CMPS(cmps); ECS_POP_CMP(cmps)) {
+        cmp_t c = ECS_LOW_CMP(cmps);
+        ecs_col_copy(&dst->cols[c], (size_t)row, &src->cols[c], from.row);
+    }
+    ecs_arch_pop(ecs, from.arch, from.row);
+    return row;
+}
 
 
 /* Helper functions */
 
+// Column holding an entity's component, and its element there, NULL when its archetype has none
+static inline ecs_col_t* ecs_cmp_col(ecs_t* ecs, ent_t ent, cmp_t cmp_id, size_t* i) {
+    *i = ENT_INDEX(ent);
+    if (CHECK_BIT(ecs->sparse_cmps, cmp_id)) {
+        *i = ECS_REF(uint32_t, &ecs->sparse[cmp_id].index, *i);
+        return &ecs->data[cmp_id];
+    }
+    if (ecs->flags & ECS_ARCHETYPES) {
+        ecs_rec_t rec = ECS_REF(ecs_rec_t, &ecs->ent_recs, *i);
+        *i = rec.row;
+        return CHECK_BIT(ecs->archs[rec.arch].cmps, cmp_id) ? &ecs->archs[rec.arch].cols[cmp_id] : NULL;
+    }
+    return &ecs->data[cmp_id];
+}
+
+// Column element of a component, the blob_t of a pooled one, the first lane of a split one
+static inline void* ecs_cmp_at(ecs_t* ecs, ent_t ent, cmp_t cmp_id) {
+    size_t i;
+    ecs_col_t* col = ecs_cmp_col(ecs, ent, cmp_id, &i);
+    return col ? ECS_ROW(col, i) : NULL;
+}
+
 // Easy component access for systems
 static inline void* get_cmp(ecs_t* ecs, ent_t ent, cmp_t cmp_id) {
-    return &ecs->data[cmp_id][ent * MAX_CMP_SIZE];
+    void* data = ecs_cmp_at(ecs, ent, cmp_id);
+    if (data && CHECK_BIT(ecs->pooled_cmps, cmp_id)) return ecs_pool_at(ecs->pools[cmp_id], ((blob_t*)data)->ref);
+    return data;
+}
+
+// Field at byte `offset` of a component, whatever its layout, the way to reach split components
+static inline void* get_field(ecs_t* ecs, ent_t ent, cmp_t cmp_id, size_t offset) {
+    if (CHECK_BIT(ecs->pooled_cmps, cmp_id)) {
+        uint8_t* data = (uint8_t*)get_cmp(ecs, ent, cmp_id);
+        return data ? data + offset : NULL;
+    }
+    size_t i;
+    ecs_col_t* col = ecs_cmp_col(ecs, ent, cmp_id, &i);
+    return col ? ecs_col_byte(col, i, offset) : NULL;
+}
+#define GET_FIELD(ecs, ent, type, cmp_id, field) ((__typeof__(((type*)0)->field)*)get_field((ecs), (ent), (cmp_id), offsetof(type, field)))
+
+// Data of a pooled component from its blob, e.g. a VIEW_CMP(view, blob_t, cmp_id) element
+static inline void* blob_data(ecs_t* ecs, cmp_t cmp_id, const blob_t* blob) {
+    return ecs_pool_at(ecs->pools[cmp_id], blob->ref);
+}
+#define VIEW_BLOB(ecs, view, cmp_id, i) blob_data((ecs), (cmp_id), &VIEW_CMP(view, blob_t, cmp_id)[i])
+
+// Bytes of a component, as given to add_cmp or resize_cmp for a pooled one
+static inline size_t cmp_size(ecs_t* ecs, ent_t ent, cmp_t cmp_id) {
+    if (CHECK_BIT(ecs->pooled_cmps, cmp_id)) {
+        blob_t* blob = (blob_t*)ecs_cmp_at(ecs, ent, cmp_id);
+        return blob ? blob->size : 0;
+    }
+    return ecs->cmp_info[cmp_id].size;
+}
+
+// Change ticks
+//// Stamp a tracked component of entity index i with the current tick
+static inline void ecs_tick_stamp(ecs_t* ecs, size_t i, cmp_t cmp_id, int added) {
+    ecs_col_t* col = &ecs->ticks[cmp_id];
+    uint8_t** block = &col->blocks[i >> ECS_BLOCK_SHIFT];
+    if (!*block) { // Zeroed, so entries never written read as never changed
+        if (!(*block = ecs_block_alloc(col->stride << ECS_BLOCK_SHIFT, ecs->flags))) return; // Out of memory, the change is missed
+        memset(*block, 0, col->stride << ECS_BLOCK_SHIFT);
+    } else if (ECS_OWN(ecs, col, i)) return; // Out of memory, the change is missed
+    uint32_t now = ecs->tick + 1;
+    ecs_tick_t* tick = &ECS_REF(ecs_tick_t, col, i);
+    tick->changed = now;
+    if (added) tick->added = now;
+    col->epochs[i >> ECS_BLOCK_SHIFT] = now;
+}
+//// Ticks of a tracked component, zeroes when never stamped
+static inline ecs_tick_t ecs_tick_get(ecs_t* ecs, size_t i, cmp_t cmp_id) {
+    ecs_col_t* col = &ecs->ticks[cmp_id];
+    if (!col->blocks || !col->blocks[i >> ECS_BLOCK_SHIFT]) return (ecs_tick_t){ 0, 0 };
+    return ECS_REF(ecs_tick_t, col, i);
 }
 
-// Component mask generator
-static inline cmps_t cmps(int count, ...) {
-    uint64_t bitmask = 0;
+// Mark a component of every entity in a view as written, for batch systems feeding change detection
+static inline void touch_view(ecs_t* ecs, const view_t* view, cmp_t cmp_id) {
+    if (!CHECK_BIT(ecs->tracked_cmps, cmp_id)) return;
+    for (size_t i = 0; i < view->count; ++i) ecs_tick_stamp(ecs, ENT_INDEX(view->ents[i]), cmp_id, 0);
+}
+
+// Component access for writes, marks the block for snapshots and stamps tracked components
+static inline void* get_cmp_mut(ecs_t* ecs, ent_t ent, cmp_t cmp_id) {
+    if (ecs->flags & (ECS_SNAPSHOTS | ECS_FORKED)) {
+        size_t i = ENT_INDEX(ent);
+        if (CHECK_BIT(ecs->sparse_cmps, cmp_id)) i = ECS_REF(uint32_t, &ecs->sparse[cmp_id].index, i);
+        if (ECS_OWN(ecs, &ecs->data[cmp_id], i)) return NULL; // Out of memory copying a borrowed block
+        ECS_DIRTY(ecs, &ecs->data[cmp_id], i);
+    }
+    void* data = get_cmp(ecs, ent, cmp_id);
+    if (data && CHECK_BIT(ecs->tracked_cmps, cmp_id)) ecs_tick_stamp(ecs, ENT_INDEX(ent), cmp_id, 0);
+    return data;
+}
+
+// Field access for writes, see get_cmp_mut
+static inline void* get_field_mut(ecs_t* ecs, ent_t ent, cmp_t cmp_id, size_t offset) {
+    return get_cmp_mut(ecs, ent, cmp_id) ? get_field(ecs, ent, cmp_id, offset) : NULL;
+}
+#define GET_FIELD_MUT(ecs, ent, type, cmp_id, field) ((__typeof__(((type*)0)->field)*)get_field_mut((ecs), (ent), (cmp_id), offsetof(type, field)))
+
+// Close the current tick and return it, writes after this are stamped later
+static inline uint32_t tick_ecs(ecs_t* ecs) {
+    return ++ecs->tick;
+}
+
+// Whether a tracked component was written (or added) after tick `since`
+static inline int cmp_changed(ecs_t* ecs, ent_t ent, cmp_t cmp_id, uint32_t since) {
+    return ecs_tick_get(ecs, ENT_INDEX(ent), cmp_id).changed > since;
+}
+
+// Whether a tracked component was added after tick `since`
+static inline int cmp_added(ecs_t* ecs, ent_t ent, cmp_t cmp_id, uint32_t since) {
+    return ecs_tick_get(ecs, ENT_INDEX(ent), cmp_id).added > since;
+}
+
+// Liveness check, stale handles from destroyed entities fail it
+static inline int is_alive(ecs_t* ecs, ent_t ent) {
+    if (ENT_INDEX(ent) >= ecs->ent_count) return 0;
+    ecs_slot_t slot = ECS_REF(ecs_slot_t, &ecs->ent_slots, ENT_INDEX(ent));
+    return slot.gen == ENT_GEN(ent) && slot.pos != ECS_DEAD;
+}
+
+// Component mask of an entity
+static inline cmps_t get_cmps(ecs_t* ecs, ent_t ent) {
+    return ECS_REF(cmps_t, &ecs->ent_cmps, ENT_INDEX(ent));
+}
+
+// Component mask generator (va_list functions cannot be force-inlined)
+static __attribute__((unused)) cmps_t cmps(int count, ...) {
+    cmps_t bitmask = ECS_NO_CMPS;
     va_list args;
     va_start(args, count);
-    
+
     for (int i = 0; i < count; i++) {
         int bit = va_arg(args, int);
-        bitmask |= (1ULL << bit);
+        SET_BIT(bitmask, bit);
     }
-    
+
     va_end(args);
     return bitmask;
 }
 
 
+#if defined(ECS_THREADS)
+// Index of the worker running on this thread, set by the pool
+//   Weak, so every translation unit including ecs.h shares the one per thread.
+__attribute__((weak)) _Thread_local size_t ecs_worker_index = 0;
+#endif
+
+/* Profiling */
+//   With ECS_PROFILE every runner records its wall time, the entities it
+//   examined and ran on, and the structural changes made meanwhile, into
+//   the profile attached to the world. Without it the hooks are empty.
+#if defined(ECS_PROFILE)
+
+typedef struct {
+    uint64_t start;
+    uint64_t changes;
+} ecs_prof_mark_t;
+
+static inline uint64_t ecs_prof_now(void) {
+    struct timespec t;
+#if defined(CLOCK_MONOTONIC)
+    clock_gettime(CLOCK_MONOTONIC, &t);
+#else // Strict C11 hides the POSIX clocks, the wall clock is steady enough for a frame
+    timespec_get(&t, TIME_UTC);
+#endif
+    return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+//// Start recording, the profile reads zero everywhere
+ECS_COLD int init_prof(prof_t* prof) {
+    memset(prof, 0, sizeof(prof_t));
+    if (!(prof->events = (prof_event_t*)malloc(ECS_PROFILE_EVENTS * sizeof(prof_event_t)))) return -1;
+    prof->origin = ecs_prof_now();
+#if defined(ECS_THREADS)
+    pthread_mutex_init(&prof->lock, NULL);
+#endif
+    return 0;
+}
+//// Release a profile, detach it from its worlds first
+ECS_COLD void free_prof(prof_t* prof) {
+    free(prof->systems);
+    free(prof->events);
+#if defined(ECS_THREADS)
+    pthread_mutex_destroy(&prof->lock);
+#endif
+    memset(prof, 0, sizeof(prof_t));
+}
+//// Zero the aggregates and drop the events, names are kept
+ECS_COLD void reset_prof(prof_t* prof) {
+    for (size_t k = 0; k < prof->count; ++k) {
+        prof_sys_t* sys = &prof->systems[k];
+        *sys = (prof_sys_t){ .system = sys->system, .name = sys->name, .kind = sys->kind };
+    }
+    prof->creates = prof->destroys = prof->adds = prof->dels = 0;
+    prof->event_count = 0;
+}
+//// Aggregates of a system, created on first sight, NULL when out of memory
+ECS_COLD prof_sys_t* ecs_prof_sys(prof_t* prof, const void* system, const char* kind) {
+    for (size_t k = 0; k < prof->count; ++k) {
+        if (prof->systems[k].system == system) return &prof->systems[k];
+    }
+    if (prof->count == prof->cap) {
+        size_t cap = prof->cap ? prof->cap * 2 : 32;
+        prof_sys_t* systems = (prof_sys_t*)realloc(prof->systems, cap * sizeof(prof_sys_t));
+        if (!systems) return NULL;
+        prof->systems = systems;
+        prof->cap = cap;
+    }
+    prof->systems[prof->count] = (prof_sys_t){ .system = system, .kind = kind };
+    return &prof->systems[prof->count++];
+}
+//// Aggregates of a system, NULL when it never ran or was named
+static inline const prof_sys_t* prof_system(prof_t* prof, const void* system) {
+    for (size_t k = 0; k < prof->count; ++k) {
+        if (prof->systems[k].system == system) return &prof->systems[k];
+    }
+    return NULL;
+}
+//// Name a system for reports and traces, the string must outlive the profile
+ECS_COLD int name_system(prof_t* prof, const void* system, const char* name) {
+    prof_sys_t* sys = ecs_prof_sys(prof, system, "run");
+    if (!sys) return -1;
+    sys->name = name;
+    return 0;
+}
+static inline void ecs_prof_push(prof_t* prof, prof_event_t event) {
+    prof->events[prof->event_count++ % ECS_PROFILE_EVENTS] = event;
+}
+//// Mark the end of a frame in the trace
+ECS_COLD void prof_frame(prof_t* prof) {
+    uint64_t now = ecs_prof_now();
+#if defined(ECS_THREADS)
+    pthread_mutex_lock(&prof->lock);
+#endif
+    ecs_prof_push(prof, (prof_event_t){ UINT32_MAX, 0, now - prof->origin, 0, 0, 0 });
+#if defined(ECS_THREADS)
+    pthread_mutex_unlock(&prof->lock);
+#endif
+}
+
+static inline ecs_prof_mark_t ecs_prof_begin(ecs_t* ecs) {
+    prof_t* prof = ecs->prof;
+    if (!prof) return (ecs_prof_mark_t){ 0, 0 };
+    return (ecs_prof_mark_t){ ecs_prof_now(), prof->creates + prof->destroys + prof->adds + prof->dels };
+}
+ECS_COLD void ecs_prof_end(ecs_t* ecs, ecs_prof_mark_t mark, const void* system, const char* kind, size_t visited, size_t matched) {
+    prof_t* prof = ecs->prof;
+    if (!prof) return;
+    uint64_t now = ecs_prof_now(), ns = now - mark.start;
+#if defined(ECS_THREADS)
+    pthread_mutex_lock(&prof->lock);
+#endif
+    prof_sys_t* sys = ecs_prof_sys(prof, system, kind);
+    if (sys) {
+        sys->calls++;
+        sys->ns += ns;
+        if (ns > sys->max_ns) sys->max_ns = ns;
+        sys->visited += visited;
+        sys->matched += matched;
+        sys->changes += prof->creates + prof->destroys + prof->adds + prof->dels - mark.changes;
+#if defined(ECS_THREADS)
+        uint32_t tid = (uint32_t)ecs_worker_index;
+#else
+        uint32_t tid = 0;
+#endif
+        ecs_prof_push(prof, (prof_event_t){ (uint32_t)(sys - prof->systems), tid, mark.start - prof->origin, ns, visited, matched });
+    }
+#if defined(ECS_THREADS)
+    pthread_mutex_unlock(&prof->lock);
+#endif
+}
+
+//// Print the aggregates, one line per system, in order of first run
+ECS_COLD void print_prof(prof_t* prof, FILE* file) {
+    fprintf(file, "%-24s %-6s %8s %12s %10s %10s %12s %12s %10s\n", "system", "kind", "calls", "total us", "mean us", "max us", "visited", "matched", "changes");
+    for (size_t k = 0; k < prof->count; ++k) {
+        const prof_sys_t* sys = &prof->systems[k];
+        char name[32];
+        if (sys->name) snprintf(name, sizeof(name), "%s", sys->name);
+        else snprintf(name, sizeof(name), "%p", sys->system);
+        fprintf(file, "%-24s %-6s %8llu %12.1f %10.2f %10.1f %12llu %12llu %10llu\n", name, sys->kind, (unsigned long long)sys->calls,
+                sys->ns / 1e3, sys->calls ? sys->ns / 1e3 / (double)sys->calls : 0.0, sys->max_ns / 1e3,
+                (unsigned long long)sys->visited, (unsigned long long)sys->matched, (unsigned long long)sys->changes);
+    }
+    fprintf(file, "creates %llu, destroys %llu, adds %llu, dels %llu\n", (unsigned long long)prof->creates,
+            (unsigned long long)prof->destroys, (unsigned long long)prof->adds, (unsigned long long)prof->dels);
+}
+//// Write the kept events as Chrome trace JSON, for chrome://tracing or Perfetto
+ECS_COLD int export_trace(prof_t* prof, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (!file) return -1;
+    uint64_t kept = prof->event_count < ECS_PROFILE_EVENTS ? prof->event_count : ECS_PROFILE_EVENTS;
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (uint64_t e = prof->event_count - kept; e < prof->event_count; ++e) {
+        const prof_event_t* event = &prof->events[e % ECS_PROFILE_EVENTS];
+        fputs(e + kept == prof->event_count ? "\n" : ",\n", file);
+        if (event->sys == UINT32_MAX) {
+            fprintf(file, "{\"name\":\"frame\",\"ph\":\"i\",\"s\":\"g\",\"pid\":0,\"tid\":0,\"ts\":%.3f}", event->start / 1e3);
+            continue;
+        }
+        const prof_sys_t* sys = &prof->systems[event->sys];
+        fputs("{\"name\":\"", file);
+        if (sys->name) {
+            for (const char* c = sys->name; *c; ++c) { // JSON string escapes
+                if (*c == '"' || *c == '\\') fputc('\\', file);
+                if ((unsigned char)*c >= 0x20) fputc(*c, file);
+            }
+        } else fprintf(file, "%p", sys->system);
+        fprintf(file, "\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"visited\":%llu,\"matched\":%llu}}",
+                sys->kind, event->tid, event->start / 1e3, event->ns / 1e3, (unsigned long long)event->visited, (unsigned long long)event->matched);
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) ? -1 : 0;
+}
+
+#define ECS_PROF_BEGIN(ecs) ecs_prof_mark_t ecs_prof_mark = ecs_prof_begin(ecs)
+#define ECS_PROF_END(ecs, system, kind, visited, matched) ecs_prof_end((ecs), ecs_prof_mark, (const void*)(system), (kind), (visited), (matched))
+#define ECS_PROF_COUNT(ecs, field, n) do { if ((ecs)->prof) (ecs)->prof->field += (n); } while (0)
+#else
+#define ECS_PROF_BEGIN(ecs) do {} while (0)
+#define ECS_PROF_END(ecs, system, kind, visited, matched) do { (void)(visited); (void)(matched); } while (0)
+#define ECS_PROF_COUNT(ecs, field, n) do {} while (0)
+#endif
+
+
 /* Core functions */
 
 // Entity management
 //// Create entity
 static inline ent_t create_ent(ecs_t* ecs) {
-    ent_t ent = (ecs->free_count > 0)
-                ? ecs->free_list[--ecs->free_count]
-                : (ecs->ent_count < MAX_ENTS)
-                  ? ecs->ent_count++
-                  : (ent_t)-1;
-    if (ent != (ent_t)-1) {
-        ecs->active_list[ecs->active_count++] = ent;
-    }
+    if (!ecs->free_count && ecs->ent_count >= ecs->capacity &&
+        (ecs->ent_count >= ECS_INDEX_MASK || ecs_grow(ecs, ecs->ent_count + 1))) return (ent_t)-1;
+
+    size_t i = (ecs->free_count > 0)
+               ? ECS_REF(ent_t, &ecs->free_list, ecs->free_count - 1)
+               : ecs->ent_count;
+    if (ECS_OWN(ecs, &ecs->ent_slots, i) || ECS_OWN(ecs, &ecs->active_list, ecs->active_count)) return (ent_t)-1;
+    ecs_slot_t* slot = &ECS_REF(ecs_slot_t, &ecs->ent_slots, i);
+    ent_t ent = MAKE_ENT(i, slot->gen);
+    if (ecs->query_count && ecs_queries_reserve(ecs, ent, 0, 0, ECS_NO_CMPS, ECS_NO_CMPS)) return (ent_t)-1;
+    if ((ecs->flags & ECS_ARCHETYPES) && ecs_arch_push(ecs, 0, ent) < 0) return (ent_t)-1;
+    if (ecs->free_count > 0) --ecs->free_count; else ++ecs->ent_count;
+
+    slot->pos = (uint32_t)ecs->active_count;
+    ECS_REF(ent_t, &ecs->active_list, ecs->active_count) = ent;
+    ECS_DIRTY(ecs, &ecs->active_list, ecs->active_count);
+    ECS_DIRTY(ecs, &ecs->ent_slots, i);
+    ++ecs->active_count;
+    if (ecs->query_count) ecs_queries_sync(ecs, ent, 0, ECS_NO_CMPS, 1, ECS_NO_CMPS);
+    ECS_PROF_COUNT(ecs, creates, 1);
     return ent;
 }
-//// Destroy entity
+//// Own every block destroy_ent writes, so a fork runs out of memory before changing anything
+ECS_COLD int ecs_destroy_own(ecs_t* ecs, ent_t ent) {
+    size_t i = ENT_INDEX(ent);
+    ent_t moved = ECS_REF(ent_t, &ecs->active_list, ecs->active_count - 1);
+    if (ecs_col_touch(&ecs->ent_cmps, i, ecs->flags) || ecs_col_touch(&ecs->free_list, ecs->free_count, ecs->flags) ||
+        ecs_col_touch(&ecs->active_list, ECS_REF(ecs_slot_t, &ecs->ent_slots, i).pos, ecs->flags) ||
+        ecs_col_touch(&ecs->ent_slots, ENT_INDEX(moved), ecs->flags) || ecs_col_touch(&ecs->ent_slots, i, ecs->flags)) return -1;
+    for (cmps_t sparse = ECS_REF(cmps_t, &ecs->ent_cmps, i) & ecs->sparse_cmps; ANY_CMPS(sparse); ECS_POP_CMP(sparse)) {
+        cmp_t c = ECS_LOW_CMP(sparse);
+        if (ecs_sparse_own(ecs, &ecs->sparse[c], &ecs->data[c], ent)) return -1;
+    }
+    return 0;
+}
+//// Destroy entity, stale handles are ignored
+////   In a fork, out of memory leaves the entity alive.
 static inline void destroy_ent(ecs_t* ecs, ent_t ent) {
-    ecs->ent_cmps[ent] = 0;
-    ecs->free_list[ecs->free_count++] = ent;
-    for (size_t i = 0; i < ecs->active_count; ++i) {
-        if (ecs->active_list[i] == ent) {
-            ecs->active_list[i] = ecs->active_list[--ecs->active_count];
-            break;
-        }
+    if (!is_alive(ecs, ent) || ((ecs->flags & ECS_FORKED) && ecs_destroy_own(ecs, ent))) return;
+    size_t i = ENT_INDEX(ent);
+    cmps_t* mask = &ECS_REF(cmps_t, &ecs->ent_cmps, i);
+    if (ecs->query_count) ecs_queries_sync(ecs, ent, 1, *mask, 0, ECS_NO_CMPS);
+    for (cmps_t pooled = *mask & ecs->pooled_cmps; ANY_CMPS(pooled); ECS_POP_CMP(pooled)) {
+        cmp_t c = ECS_LOW_CMP(pooled);
+        ecs_pool_free(ecs->pools[c], ((blob_t*)ecs_cmp_at(ecs, ent, c))->ref);
+    }
+    for (cmps_t sparse = *mask & ecs->sparse_cmps; ANY_CMPS(sparse); ECS_POP_CMP(sparse)) {
+        cmp_t c = ECS_LOW_CMP(sparse);
+        ecs_sparse_del(ecs, &ecs->sparse[c], &ecs->data[c], ent);
     }
+    if (ecs->flags & ECS_ARCHETYPES) {
+        ecs_rec_t rec = ECS_REF(ecs_rec_t, &ecs->ent_recs, i);
+        ecs_arch_pop(ecs, rec.arch, rec.row);
+    }
+    *mask = ECS_NO_CMPS;
+    ECS_REF(ent_t, &ecs->free_list, ecs->free_count) = (ent_t)i;
+    ECS_DIRTY(ecs, &ecs->ent_cmps, i);
+    ECS_DIRTY(ecs, &ecs->free_list, ecs->free_count);
+    ++ecs->free_count;
+
+    // Swap-remove from the active list through the position map
+    ecs_slot_t* slot = &ECS_REF(ecs_slot_t, &ecs->ent_slots, i);
+    ent_t moved = ECS_REF(ent_t, &ecs->active_list, ecs->active_count - 1);
+    ECS_REF(ent_t, &ecs->active_list, slot->pos) = moved;
+    ECS_REF(ecs_slot_t, &ecs->ent_slots, ENT_INDEX(moved)).pos = slot->pos;
+    ECS_DIRTY(ecs, &ecs->active_list, slot->pos);
+    ECS_DIRTY(ecs, &ecs->ent_slots, ENT_INDEX(moved));
+    ECS_DIRTY(ecs, &ecs->ent_slots, i);
+    --ecs->active_count;
+    slot->pos = ECS_DEAD;
+    slot->gen = (slot->gen + 1) % ECS_GEN_MASK; // The last generation marks pending handles
+    ECS_PROF_COUNT(ecs, destroys, 1);
 }
 
 // Component management
 //// Add component
 static inline int add_cmp(ecs_t* ecs, ent_t ent, cmp_t cmp_id, const void* data, size_t size) {
-    if (CHECK_BIT(ecs->ent_cmps[ent], cmp_id)) return -1; // Ensure the spot is open
-    if (size > MAX_CMP_SIZE || ent >= MAX_ENTS) return -1; // Ensure size does not exceed the limit and entity index is active
+    if (!is_alive(ecs, ent) || cmp_id >= MAX_CMPS) return -1; // Ensure entity is alive
+    if (ECS_OWN(ecs, &ecs->ent_cmps, ENT_INDEX(ent))) return -1;
+    cmps_t* mask = &ECS_REF(cmps_t, &ecs->ent_cmps, ENT_INDEX(ent));
+    if (CHECK_BIT(*mask, cmp_id)) return -1; // Ensure the spot is open
+    ecs_col_t* col = &ecs->data[cmp_id];
+    int pooled = CHECK_BIT(ecs->pooled_cmps, cmp_id);
+    if (pooled) { // Any size fits, the slot is reserved before anything moves
+        if (size > ECS_POOL_MAX || ecs_pool_reserve(ecs->pools[cmp_id], ecs_pool_class(size, ecs->cmp_info[cmp_id].align))) return -1;
+    } else if (size > ecs->cmp_info[cmp_id].size) return -1; // Ensure size does not exceed the registered size
+    if (ecs->query_count && ecs_queries_reserve(ecs, ent, 0, 1, *mask, *mask | ECS_BIT(cmp_id))) return -1;
 
-    SET_BIT(ecs->ent_cmps[ent], cmp_id); 
-    memcpy(&ecs->data[cmp_id][ent * MAX_CMP_SIZE], data, size);
+    size_t i = ENT_INDEX(ent);
+    if (CHECK_BIT(ecs->sparse_cmps, cmp_id)) {
+        int pos = ecs_sparse_add(ecs, &ecs->sparse[cmp_id], col, ent);
+        if (pos < 0) return -1;
+        i = (size_t)pos;
+    } else if (ecs->flags & ECS_ARCHETYPES) {
+        int32_t to = ecs_arch_edge(ecs, ECS_REF(ecs_rec_t, &ecs->ent_recs, ENT_INDEX(ent)).arch, cmp_id);
+        int row = to < 0 ? -1 : ecs_arch_move(ecs, ent, (uint32_t)to);
+        if (row < 0) return -1;
+        col = &ecs->archs[to].cols[cmp_id];
+        i = (size_t)row;
+    } else if (ecs_col_touch(col, i, ecs->flags)) return -1;
+
+    if (ecs->query_count) ecs_queries_sync(ecs, ent, 1, *mask, 1, *mask | ECS_BIT(cmp_id));
+    SET_BIT(*mask, cmp_id);
+    if (pooled) ecs_blob_set(ecs, cmp_id, (blob_t*)ECS_AT(col, i), data, size);
+    else if (size) ecs_col_write(col, i, 0, data, size);
+    ECS_DIRTY(ecs, col, i);
+    ECS_DIRTY(ecs, &ecs->ent_cmps, ENT_INDEX(ent));
+    if (CHECK_BIT(ecs->tracked_cmps, cmp_id)) ecs_tick_stamp(ecs, ENT_INDEX(ent), cmp_id, 1);
+    ECS_PROF_COUNT(ecs, adds, 1);
     return 0;
 }
 //// Delete component
 static inline int del_cmp(ecs_t* ecs, ent_t ent, cmp_t cmp_id) {
-    if (!CHECK_BIT(ecs->ent_cmps[ent], cmp_id)) return -1; // Ensure the spot is full
-         CLEAR_BIT(ecs->ent_cmps[ent], cmp_id); return 0;
+    if (!is_alive(ecs, ent) || cmp_id >= MAX_CMPS || ECS_OWN(ecs, &ecs->ent_cmps, ENT_INDEX(ent))) return -1;
+    cmps_t* mask = &ECS_REF(cmps_t, &ecs->ent_cmps, ENT_INDEX(ent));
+    if (!CHECK_BIT(*mask, cmp_id)) return -1; // Ensure the spot is full
+    if (CHECK_BIT(ecs->sparse_cmps, cmp_id) && ecs_sparse_own(ecs, &ecs->sparse[cmp_id], &ecs->data[cmp_id], ent)) return -1;
+    blob_t blob = CHECK_BIT(ecs->pooled_cmps, cmp_id) ? *(blob_t*)ecs_cmp_at(ecs, ent, cmp_id) : (blob_t){ 0, 0 };
+    if (CHECK_BIT(ecs->sparse_cmps, cmp_id)) ecs_sparse_del(ecs, &ecs->sparse[cmp_id], &ecs->data[cmp_id], ent);
+    else if (ecs->flags & ECS_ARCHETYPES) {
+        int32_t to = ecs_arch_edge(ecs, ECS_REF(ecs_rec_t, &ecs->ent_recs, ENT_INDEX(ent)).arch, cmp_id);
+        if (to < 0 || ecs_arch_move(ecs, ent, (uint32_t)to) < 0) return -1;
+    }
+    if (CHECK_BIT(ecs->pooled_cmps, cmp_id)) ecs_pool_free(ecs->pools[cmp_id], blob.ref); // Only once nothing can fail
+    if (ecs->query_count) ecs_queries_sync(ecs, ent, 1, *mask, 1, *mask & ~ECS_BIT(cmp_id));
+    ECS_DIRTY(ecs, &ecs->ent_cmps, ENT_INDEX(ent));
+    ECS_PROF_COUNT(ecs, dels, 1);
+         CLEAR_BIT(*mask, cmp_id); return 0;
          // Check bit, clear bit.
 }
+//// Resize a pooled component, keeping the bytes both sizes hold
+static inline int resize_cmp(ecs_t* ecs, ent_t ent, cmp_t cmp_id, size_t size) {
+    if (!is_alive(ecs, ent) || cmp_id >= MAX_CMPS || size > ECS_POOL_MAX || !CHECK_BIT(ecs->pooled_cmps, cmp_id) ||
+        !CHECK_BIT(ECS_REF(cmps_t, &ecs->ent_cmps, ENT_INDEX(ent)), cmp_id)) return -1;
+    ecs_pool_t* pool = ecs->pools[cmp_id];
+    blob_t* blob = (blob_t*)ecs_cmp_at(ecs, ent, cmp_id);
+    uint32_t k = ecs_pool_class(size, ecs->cmp_info[cmp_id].align);
+    if (k != blob->ref >> ECS_POOL_SLOT_BITS) { // Moves to another size class
+        if (ecs_pool_reserve(pool, k)) return -1;
+        uint32_t ref = ecs_pool_take(pool, k);
+        memcpy(ecs_pool_at(pool, ref), ecs_pool_at(pool, blob->ref), size < blob->size ? size : blob->size);
+        ecs_pool_free(pool, blob->ref);
+        blob->ref = ref;
+    }
+    blob->size = (uint32_t)size;
+    get_cmp_mut(ecs, ent, cmp_id); // Marks the write
+    return 0;
+}
 
-// System
-//// Run a system 
-static inline void run(system_t system, void* data, ecs_t* ecs, cmps_t cmps) {
-    for (size_t i = 0; i < ecs->active_count; ++i) { 
-        ent_t ent = ecs->active_list[i];
-        if ((ecs->ent_cmps[ent] & cmps) == cmps) {
-            system(ecs, ent, data);
+// Bulk
+//// Create n entities with contiguous indices past every existing one, in one step
+////   Returns the first handle (the rest follow its index) or (ent_t)-1, and
+////   fills ents when given. The free list is left alone so the range stays dense.
+static inline ent_t create_ents(ecs_t* ecs, size_t n, ent_t* ents) {
+    size_t first = ecs->ent_count;
+    if (!n || first + n > ECS_INDEX_MASK ||
+        (first + n > ecs->capacity && ecs_grow(ecs, first + n))) return (ent_t)-1;
+    for (size_t b = first >> ECS_BLOCK_SHIFT; (ecs->flags & ECS_FORKED) && b <= (first + n - 1) >> ECS_BLOCK_SHIFT; ++b) {
+        if (ecs_col_touch(&ecs->ent_slots, b << ECS_BLOCK_SHIFT, ecs->flags)) return (ent_t)-1;
+    }
+    for (size_t b = ecs->active_count >> ECS_BLOCK_SHIFT; (ecs->flags & ECS_FORKED) && b <= (ecs->active_count + n - 1) >> ECS_BLOCK_SHIFT; ++b) {
+        if (ecs_col_touch(&ecs->active_list, b << ECS_BLOCK_SHIFT, ecs->flags)) return (ent_t)-1;
+    }
+    for (size_t k = 0; ecs->query_count && k < n; ++k) { // Only the index of the handle matters
+        if (ecs_queries_reserve(ecs, MAKE_ENT(first + k, 0), k, 0, ECS_NO_CMPS, ECS_NO_CMPS)) return (ent_t)-1;
+    }
+
+    if (ecs->flags & ECS_ARCHETYPES) { // Rows land in the empty archetype, a chunk at a time
+        ecs_arch_t* arch = &ecs->archs[0];
+        while (arch->count + n > arch->chunk_count << ECS_BLOCK_SHIFT) {
+            if (ecs_arch_chunk(ecs, arch)) return (ent_t)-1;
         }
-    } 
+        for (size_t k = 0; k < n; ++k) {
+            size_t row = arch->count + k;
+            ECS_REF(ent_t, &arch->ents, row) = MAKE_ENT(first + k, ECS_REF(ecs_slot_t, &ecs->ent_slots, first + k).gen);
+            ECS_REF(ecs_rec_t, &ecs->ent_recs, first + k) = (ecs_rec_t){ 0, (uint32_t)row };
+        }
+        arch->count += n;
+    }
+    for (size_t k = 0, len; k < n; k += len) { // Block at a time, plain loops over plain arrays
+        len = ECS_BLOCK_ENTS - ((first + k) & ECS_BLOCK_MASK);
+        if (len > n - k) len = n - k;
+        ecs_slot_t* slots = &ECS_REF(ecs_slot_t, &ecs->ent_slots, first + k);
+        for (size_t r = 0; r < len; ++r) slots[r].pos = (uint32_t)(ecs->active_count + k + r);
+        ECS_DIRTY(ecs, &ecs->ent_slots, first + k);
+    }
+    for (size_t k = 0, len; k < n; k += len) {
+        len = ECS_BLOCK_ENTS - ((ecs->active_count + k) & ECS_BLOCK_MASK);
+        if (len > n - k) len = n - k;
+        ent_t* active = &ECS_REF(ent_t, &ecs->active_list, ecs->active_count + k);
+        for (size_t r = 0; r < len; ++r) active[r] = MAKE_ENT(first + k + r, ECS_REF(ecs_slot_t, &ecs->ent_slots, first + k + r).gen);
+        ECS_DIRTY(ecs, &ecs->active_list, ecs->active_count + k);
+    }
+    for (size_t k = 0; ents && k < n; ++k) ents[k] = MAKE_ENT(first + k, ECS_REF(ecs_slot_t, &ecs->ent_slots, first + k).gen);
+    ecs->ent_count += n;
+    ecs->active_count += n;
+    for (size_t q = 0; q < ecs->query_count; ++q) {
+        if (ANY_CMPS(ecs->queries[q]->cmps)) continue; // Only empty masks match new entities
+        for (size_t k = 0; k < n; ++k) ecs_queries_sync(ecs, MAKE_ENT(first + k, ECS_REF(ecs_slot_t, &ecs->ent_slots, first + k).gen), 0, ECS_NO_CMPS, 1, ECS_NO_CMPS);
+        break;
+    }
+    ECS_PROF_COUNT(ecs, creates, n);
+    return MAKE_ENT(first, ECS_REF(ecs_slot_t, &ecs->ent_slots, first).gen);
+}
+//// Length of the run of consecutive indices at ents[k], within one block
+static inline size_t ecs_run_len(const ent_t* ents, size_t k, size_t n) {
+    size_t i = ENT_INDEX(ents[k]), len = 1, max = ECS_BLOCK_ENTS - (i & ECS_BLOCK_MASK);
+    if (max > n - k) max = n - k;
+    while (len < max && ENT_INDEX(ents[k + len]) == i + len) ++len;
+    return len;
 }
+//// Add a component to n distinct entities from a packed source array, all or nothing
+////   data holds n values of `size` bytes. Entities are checked and written a
+////   run of consecutive indices at a time, through plain block pointers.
+static inline int add_cmp_bulk(ecs_t* ecs, const ent_t* ents, size_t n, cmp_t cmp_id, const void* data, size_t size) {
+    if (cmp_id >= MAX_CMPS || (size > ecs->cmp_info[cmp_id].size && !CHECK_BIT(ecs->pooled_cmps, cmp_id))) return -1;
+    for (size_t k = 0, len; k < n; k += len) { // Branch-free over each run
+        len = ecs_run_len(ents, k, n);
+        size_t i = ENT_INDEX(ents[k]);
+        if (i >= ecs->ent_count) return -1;
+        const ecs_slot_t* slots = &ECS_REF(ecs_slot_t, &ecs->ent_slots, i);
+        const cmps_t* masks = &ECS_REF(cmps_t, &ecs->ent_cmps, i);
+        int bad = 0;
+        for (size_t r = 0; r < len; ++r) {
+            bad |= (slots[r].gen != ENT_GEN(ents[k + r])) | (slots[r].pos == ECS_DEAD) | CHECK_BIT(masks[r], cmp_id);
+        }
+        if (bad) return -1;
+    }
+    const uint8_t* src = (const uint8_t*)data;
+    if (CHECK_BIT(ecs->sparse_cmps | ecs->pooled_cmps, cmp_id) || (ecs->flags & ECS_ARCHETYPES)) { // Rows move (or blobs allocate) one at a time anyway
+        for (size_t k = 0; k < n; ++k) {
+            if (add_cmp(ecs, ents[k], cmp_id, src + k * size, size)) return -1; // Only on out of memory
+        }
+        return 0;
+    }
 
-// Serialization
-//// Save
-static inline int save_ecs(ecs_t* ecs, const char* filename) {
-    if (!ecs || !filename) return -1;
+    ecs_col_t* col = &ecs->data[cmp_id];
+    for (size_t k = 0, len; k < n; k += len) {
+        len = ecs_run_len(ents, k, n);
+        size_t i = ENT_INDEX(ents[k]);
+        if (ecs_col_touch(col, i, ecs->flags) || ECS_OWN(ecs, &ecs->ent_cmps, i)) return -1;
+        cmps_t* masks = &ECS_REF(cmps_t, &ecs->ent_cmps, i);
+        for (size_t r = 0; ecs->query_count && r < len; ++r) {
+            if (ecs_queries_reserve(ecs, ents[k + r], r, 1, masks[r], masks[r] | ECS_BIT(cmp_id))) return -1;
+        }
+        if (size && size == col->stride && !col->lane) memcpy(ECS_AT(col, i), src + k * size, len * size); // Whole run in one copy
+        else for (size_t r = 0; r < len && size; ++r) ecs_col_write(col, i + r, 0, src + (k + r) * size, size);
+        if (ecs->query_count) {
+            for (size_t r = 0; r < len; ++r) ecs_queries_sync(ecs, ents[k + r], 1, masks[r], 1, masks[r] | ECS_BIT(cmp_id));
+        }
+        for (size_t r = 0; r < len; ++r) SET_BIT(masks[r], cmp_id);
+        ECS_DIRTY(ecs, col, i);
+        ECS_DIRTY(ecs, &ecs->ent_cmps, i);
+        if (CHECK_BIT(ecs->tracked_cmps, cmp_id)) {
+            for (size_t r = 0; r < len; ++r) ecs_tick_stamp(ecs, i + r, cmp_id, 1);
+        }
+    }
+    ECS_PROF_COUNT(ecs, adds, n);
+    return 0;
+}
 
-    FILE* file = fopen(filename, "wb");
-    if (!file) return -1;
+// Matching
+//// Indices of masks[0, n) containing cmps, compacted a vector at a time into out
+static inline size_t ecs_match_block(const cmps_t* masks, size_t n, cmps_t cmps, ent_t base, ent_t* out) {
+    size_t count = 0, i = 0;
+#if ECS_MASK_BITS > 64 // Wide masks are one or two vptests each, the scalar loop below is already SIMD
+#elif defined(__AVX2__) && defined(__BMI2__)
+    __m256i want = _mm256_set1_epi64x((long long)cmps);
+    for (; i + 8 <= n; i += 8) {
+        __m256i lo = _mm256_loadu_si256((const __m256i*)(masks + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i*)(masks + i + 4));
+        lo = _mm256_cmpeq_epi64(_mm256_and_si256(lo, want), want);
+        hi = _mm256_cmpeq_epi64(_mm256_and_si256(hi, want), want);
+        unsigned bits = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(lo))
+                      | (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4;
+        // Byte lane numbers of the set bits, packed to the bottom, widened to indices
+        uint64_t lanes = _pext_u64(0x0706050403020100ULL, _pdep_u64(bits, 0x0101010101010101ULL) * 0xFF);
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128((long long)lanes));
+        _mm256_storeu_si256((__m256i*)(out + count), _mm256_add_epi32(idx, _mm256_set1_epi32((int)(base + i))));
+        count += (size_t)__builtin_popcount(bits); // count <= i, the 8 lane store stays inside out[0, n)
+    }
+#elif defined(__SSE2__)
+    static const uint32_t lanes[16] = { // Lane numbers of each 4-bit pattern, one per byte
+        0x00000000, 0x00000000, 0x00000001, 0x00000100, 0x00000002, 0x00000200, 0x00000201, 0x00020100,
+        0x00000003, 0x00000300, 0x00000301, 0x00030100, 0x00000302, 0x00030200, 0x00030201, 0x03020100,
+    };
+    __m128i want = _mm_set1_epi64x((long long)cmps), zero = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) { // No 64-bit compare in SSE2, AND the two 32-bit halves
+        __m128i lo = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i*)(masks + i)), want), want);
+        __m128i hi = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i*)(masks + i + 2)), want), want);
+        lo = _mm_and_si128(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+        hi = _mm_and_si128(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+        unsigned bits = (unsigned)_mm_movemask_pd(_mm_castsi128_pd(lo))
+                      | (unsigned)_mm_movemask_pd(_mm_castsi128_pd(hi)) << 2;
+        __m128i idx = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)lanes[bits]), zero), zero);
+        _mm_storeu_si128((__m128i*)(out + count), _mm_add_epi32(idx, _mm_set1_epi32((int)(base + i))));
+        count += (size_t)__builtin_popcount(bits);
+    }
+#endif
+    for (; i < n; ++i) { // Scalar tail and fallback, branch-free
+        out[count] = base + (ent_t)i;
+        count += CHECK_CMPS(masks[i], cmps);
+    }
+    return count;
+}
+//// Indices in [start, end) containing cmps, `end` must stay inside start's block
+static inline size_t ecs_match_range(ecs_t* ecs, cmps_t cmps, size_t start, size_t end, ent_t* out) {
+    const cmps_t* masks = &ECS_REF(cmps_t, &ecs->ent_cmps, start);
+    return ecs_match_block(masks, end - start, cmps, (ent_t)start, out);
+}
+//// Fill a match list with every live entity containing cmps, in index order
+ECS_COLD int match_ents(ecs_t* ecs, cmps_t cmps, match_t* match) {
+    size_t need = ANY_CMPS(cmps) ? ecs->ent_count : ecs->active_count;
+    if (need > match->cap) {
+        ent_t* ents = (ent_t*)realloc(match->ents, need * sizeof(ent_t));
+        if (!ents) return -1;
+        match->ents = ents;
+        match->cap = need;
+    }
+    match->cmps = cmps;
+    match->count = 0;
+    if (!ANY_CMPS(cmps)) { // Empty masks match dead slots too, the active list is exact
+        for (size_t i = 0; i < ecs->active_count; ++i) match->ents[i] = ECS_REF(ent_t, &ecs->active_list, i);
+        match->count = ecs->active_count;
+        return 0;
+    }
+    for (size_t start = 0; start < ecs->ent_count; start += ECS_BLOCK_ENTS) {
+        size_t end = start + ECS_BLOCK_ENTS < ecs->ent_count ? start + ECS_BLOCK_ENTS : ecs->ent_count;
+        match->count += ecs_match_range(ecs, cmps, start, end, match->ents + match->count);
+    }
+    for (size_t i = 0; i < match->count; ++i) { // Indices to handles
+        match->ents[i] = MAKE_ENT(match->ents[i], ECS_REF(ecs_slot_t, &ecs->ent_slots, match->ents[i]).gen);
+    }
+    return 0;
+}
+//// Fill a match list with the entities containing cmps whose tracked component
+//// was changed (or only added) after tick `since`, blocks with no newer tick are skipped
+ECS_COLD int ecs_match_ticks(ecs_t* ecs, cmps_t cmps, cmp_t cmp_id, uint32_t since, int added, match_t* match) {
+    if (cmp_id >= MAX_CMPS || !CHECK_BIT(ecs->tracked_cmps, cmp_id)) return -1;
+    if (ecs->ent_count > match->cap) {
+        ent_t* ents = (ent_t*)realloc(match->ents, ecs->ent_count * sizeof(ent_t));
+        if (!ents) return -1;
+        match->ents = ents;
+        match->cap = ecs->ent_count;
+    }
+    SET_BIT(cmps, cmp_id);
+    match->cmps = cmps;
+    match->count = 0;
+    ecs_col_t* col = &ecs->ticks[cmp_id];
+    for (size_t start = 0; start < ecs->ent_count; start += ECS_BLOCK_ENTS) {
+        size_t b = start >> ECS_BLOCK_SHIFT;
+        if (!col->blocks[b] || col->epochs[b] <= since) continue; // Nothing newer in this block
+        size_t end = start + ECS_BLOCK_ENTS < ecs->ent_count ? start + ECS_BLOCK_ENTS : ecs->ent_count;
+        ent_t* out = match->ents + match->count;
+        size_t n = ecs_match_range(ecs, cmps, start, end, out), kept = 0;
+        const ecs_tick_t* ticks = (const ecs_tick_t*)col->blocks[b];
+        for (size_t k = 0; k < n; ++k) { // Branch-free compaction
+            const ecs_tick_t* tick = &ticks[out[k] - start];
+            out[kept] = out[k];
+            kept += (added ? tick->added : tick->changed) > since;
+        }
+        match->count += kept;
+    }
+    for (size_t i = 0; i < match->count; ++i) { // Indices to handles
+        match->ents[i] = MAKE_ENT(match->ents[i], ECS_REF(ecs_slot_t, &ecs->ent_slots, match->ents[i]).gen);
+    }
+    return 0;
+}
+//// Entities containing cmps whose component cmp_id was written or added after `since`
+static inline int match_changed(ecs_t* ecs, cmps_t cmps, cmp_t cmp_id, uint32_t since, match_t* match) {
+    return ecs_match_ticks(ecs, cmps, cmp_id, since, 0, match);
+}
+//// Entities containing cmps whose component cmp_id was added after `since`
+static inline int match_added(ecs_t* ecs, cmps_t cmps, cmp_t cmp_id, uint32_t since, match_t* match) {
+    return ecs_match_ticks(ecs, cmps, cmp_id, since, 1, match);
+}
+//// Release a match list
+ECS_COLD void free_match(match_t* match) {
+    free(match->ents);
+    memset(match, 0, sizeof(match_t));
+}
 
-    fwrite(ecs, sizeof(ecs_t), 1, file);
-    fclose(file);
+// Cached queries
+//// Rebuild a query's set from the active list
+ECS_COLD int ecs_query_fill(ecs_t* ecs, query_t* query) {
+    size_t blocks = ecs->capacity >> ECS_BLOCK_SHIFT;
+    if (ecs_col_grow(&query->ents, blocks, ecs->flags, 0) ||
+        ecs_col_grow(&query->index, blocks, ecs->flags, 0)) return -1;
+    query->count = 0;
+    for (size_t i = 0; i < ecs->active_count; ++i) {
+        ent_t ent = ECS_REF(ent_t, &ecs->active_list, i);
+        if (!CHECK_CMPS(get_cmps(ecs, ent), query->cmps)) continue;
+        if (ecs_col_touch(&query->ents, query->count, ecs->flags) ||
+            ecs_col_touch(&query->index, ENT_INDEX(ent), ecs->flags)) return -1;
+        ECS_REF(ent_t, &query->ents, query->count) = ent;
+        ECS_REF(uint32_t, &query->index, ENT_INDEX(ent)) = (uint32_t)query->count;
+        query->count++;
+    }
+    return 0;
+}
+//// Register a query, owned by the world until destroy_query or deinit_ecs
+ECS_COLD query_t* create_query(ecs_t* ecs, cmps_t cmps) {
+    if (!ecs->ent_cmps.stride && ecs_grow(ecs, 0)) return NULL;
+    query_t** queries = (query_t**)realloc(ecs->queries, (ecs->query_count + 1) * sizeof(query_t*));
+    if (!queries) return NULL;
+    ecs->queries = queries;
+
+    query_t* query = (query_t*)calloc(1, sizeof(query_t));
+    if (!query) return NULL;
+    query->cmps = cmps;
+    query->ents.stride = sizeof(ent_t);
+    query->index.stride = sizeof(uint32_t);
+    if (ecs_query_fill(ecs, query)) {
+        ecs_col_free(&query->ents, ecs->flags);
+        ecs_col_free(&query->index, ecs->flags);
+        free(query);
+        return NULL;
+    }
+    queries[ecs->query_count++] = query;
+    return query;
+}
+//// Unregister and free a query
+ECS_COLD void destroy_query(ecs_t* ecs, query_t* query) {
+    for (size_t q = 0; q < ecs->query_count; ++q) {
+        if (ecs->queries[q] != query) continue;
+        ecs->queries[q] = ecs->queries[--ecs->query_count];
+        ecs_col_free(&query->ents, ecs->flags);
+        ecs_col_free(&query->index, ecs->flags);
+        free(query);
+        return;
+    }
+}
+
+// System
+//// Run a system over a cached query, no filtering at all
+static inline void run_query(system_t system, void* data, ecs_t* ecs, query_t* query) {
+    ECS_PROF_BEGIN(ecs);
+    size_t matched = 0;
+    for (size_t i = query->count; i-- > 0;) { // Backwards, so swap-removes never skip
+        if (i >= query->count) continue;
+        system(ecs, ECS_REF(ent_t, &query->ents, i), data);
+        ++matched;
+    }
+    ECS_PROF_END(ecs, system, "query", matched, matched);
+}
+//// Run a system over a match list, entities changed since matching are skipped
+static inline void run_match(system_t system, void* data, ecs_t* ecs, match_t* match) {
+    ECS_PROF_BEGIN(ecs);
+    size_t matched = 0;
+    for (size_t i = 0; i < match->count; ++i) {
+        ent_t ent = match->ents[i];
+        if (is_alive(ecs, ent) && CHECK_CMPS(get_cmps(ecs, ent), match->cmps)) {
+            system(ecs, ent, data);
+            ++matched;
+        }
+    }
+    ECS_PROF_END(ecs, system, "match", match->count, matched);
+}
+//// Run a system, returns how many entities it ran on
+static inline size_t ecs_run(system_t system, void* data, ecs_t* ecs, cmps_t cmps, size_t* visited) {
+    size_t matched = 0;
+    if (ANY_CMPS(cmps & ecs->sparse_cmps)) { // Drive from the smallest sparse set
+        ecs_sparse_t* set = NULL;
+        for (cmps_t sparse = cmps & ecs->sparse_cmps; ANY_CMPS(sparse); ECS_POP_CMP(sparse)) {
+            ecs_sparse_t* s = &ecs->sparse[ECS_LOW_CMP(sparse)];
+            if (!set || s->count < set->count) set = s;
+        }
+        *visited = set->count;
+        for (size_t i = set->count; i-- > 0;) { // Backwards, so swap-removes never skip
+            if (i >= set->count) continue;
+            ent_t ent = ECS_REF(ent_t, &set->dense, i);
+            if (CHECK_CMPS(ECS_REF(cmps_t, &ecs->ent_cmps, ENT_INDEX(ent)), cmps)) {
+                system(ecs, ent, data);
+                ++matched;
+            }
+        }
+        return matched;
+    }
+    if (ecs->flags & ECS_ARCHETYPES) { // Linear scans over every matching archetype
+        for (size_t a = 0; a < ecs->arch_count; ++a) {
+            if (!CHECK_CMPS(ecs->archs[a].cmps, cmps)) continue;
+            *visited += ecs->archs[a].count;
+            for (size_t i = ecs->archs[a].count; i-- > 0;) {
+                if (i >= ecs->archs[a].count) continue;
+                system(ecs, ECS_REF(ent_t, &ecs->archs[a].ents, i), data);
+                ++matched;
+            }
+        }
+        return matched;
+    }
+    if (ANY_CMPS(cmps)) { // Vectorized match, a batch of indices at a time, in index order
+        ent_t hits[ECS_BATCH];
+        *visited = ecs->ent_count;
+        for (size_t start = 0, end; start < ecs->ent_count; start = end) {
+            end = (start | ECS_BLOCK_MASK) + 1;
+            if (end > start + ECS_BATCH) end = start + ECS_BATCH;
+            if (end > ecs->ent_count) end = ecs->ent_count;
+            size_t n = ecs_match_range(ecs, cmps, start, end, hits);
+            for (size_t j = 0; j < n; ++j) {
+                size_t i = hits[j];
+                if (!CHECK_CMPS(ECS_REF(cmps_t, &ecs->ent_cmps, i), cmps)) continue; // Changed by the system
+                system(ecs, MAKE_ENT(i, ECS_REF(ecs_slot_t, &ecs->ent_slots, i).gen), data);
+                ++matched;
+            }
+        }
+        return matched;
+    }
+    *visited = ecs->active_count;
+    for (size_t i = 0; i < ecs->active_count; ++i) {
+        ent_t ent = ECS_REF(ent_t, &ecs->active_list, i);
+        if (CHECK_CMPS(ECS_REF(cmps_t, &ecs->ent_cmps, ENT_INDEX(ent)), cmps)) {
+            system(ecs, ent, data);
+            ++matched;
+        }
+    }
+    return matched;
+}
+//// Run a system
+static inline void run(system_t system, void* data, ecs_t* ecs, cmps_t cmps) {
+    ECS_PROF_BEGIN(ecs);
+    size_t visited = 0, matched = ecs_run(system, data, ecs, cmps, &visited);
+    ECS_PROF_END(ecs, system, "run", visited, matched);
+}
+
+// Batch iteration
+enum { ECS_EACH_LONE, ECS_EACH_MIXED, ECS_EACH_ARCH, ECS_EACH_TABLE };
+
+//// Start walking the batches of entities containing cmps
+static inline void ecs_each_init(ecs_each_t* it, ecs_t* ecs, cmps_t cmps) {
+    it->ecs = ecs;
+    it->cmps = cmps;
+    it->arch = it->next = it->visited = it->matched = 0;
+    it->stop = 0;
+    it->view.count = 0;
+    if (ANY_CMPS(cmps & ecs->sparse_cmps)) { // Sparse data is packed in its own order
+        ecs_sparse_t* set = NULL;
+        for (cmps_t sparse = cmps & ecs->sparse_cmps; ANY_CMPS(sparse); ECS_POP_CMP(sparse)) {
+            cmp_t c = ECS_LOW_CMP(sparse);
+            if (!set || ecs->sparse[c].count < set->count) { set = &ecs->sparse[c]; it->driver = c; }
+        }
+        it->visited = set->count;
+        if (SAME_CMPS(cmps, ECS_BIT(it->driver))) { // Lone sparse component, its dense blocks are the batches
+            it->mode = ECS_EACH_LONE;
+            it->view.strides[it->driver] = ECS_PITCH(&ecs->data[it->driver]);
+        } else {
+            it->mode = ECS_EACH_MIXED;
+            it->next = set->count; // Backwards, so swap-removes never skip
+        }
+    } else if (ecs->flags & ECS_ARCHETYPES) {
+        it->mode = ECS_EACH_ARCH;
+    } else {
+        it->mode = ECS_EACH_TABLE;
+        it->visited = ecs->ent_count;
+        for (cmps_t m = cmps; ANY_CMPS(m); ECS_POP_CMP(m)) it->view.strides[ECS_LOW_CMP(m)] = ECS_PITCH(&ecs->data[ECS_LOW_CMP(m)]);
+    }
+}
+//// Load the next batch into it->view, 0 once there is none
+static inline int ecs_each_next(ecs_each_t* it) {
+    ecs_t* ecs = it->ecs;
+    view_t* view = &it->view;
+    cmps_t cmps = it->cmps;
+    if (it->mode == ECS_EACH_LONE) {
+        ecs_sparse_t* set = &ecs->sparse[it->driver];
+        cmp_t driver = it->driver;
+        for (size_t i; (i = it->next) < set->count;) {
+            it->next += ECS_BLOCK_ENTS;
+            view->count = set->count - i < ECS_BLOCK_ENTS ? set->count - i : ECS_BLOCK_ENTS;
+            view->ents = &ECS_REF(ent_t, &set->dense, i);
+            if (ECS_OWN(ecs, &ecs->data[driver], i)) continue; // Out of memory copying a borrowed block, skipped
+            view->cols[driver] = ECS_ROW(&ecs->data[driver], i);
+            ECS_DIRTY(ecs, &ecs->data[driver], i); // Batch columns are writable
+            it->matched += view->count;
+            return 1;
+        }
+        return 0;
+    }
+    if (it->mode == ECS_EACH_MIXED) { // Mixed storage has no shared order, one entity per batch
+        ecs_sparse_t* set = &ecs->sparse[it->driver];
+        while (it->next > 0) {
+            size_t i = --it->next;
+            if (i >= set->count) continue;
+            const ent_t* ent = &ECS_REF(ent_t, &set->dense, i);
+            if (!CHECK_CMPS(get_cmps(ecs, *ent), cmps)) continue;
+            int lost = 0;
+            for (cmps_t m = cmps; ANY_CMPS(m); ECS_POP_CMP(m)) { // Bound like the table path, ticks are left to touch_view
+                cmp_t c = ECS_LOW_CMP(m);
+                view->strides[c] = 0;
+                if (CHECK_BIT(ecs->tag_cmps, c)) { view->cols[c] = NULL; continue; }
+                size_t at;
+                ecs_col_t* col = ecs_cmp_col(ecs, *ent, c, &at);
+                lost |= ECS_OWN(ecs, col, at);
+                ECS_DIRTY(ecs, col, at);
+                view->cols[c] = ECS_ROW(col, at); // Pooled components bind their blob_t
+            }
+            if (lost) continue; // Out of memory copying a borrowed block
+            view->count = 1;
+            view->ents = ent;
+            it->matched += 1;
+            return 1;
+        }
+        return 0;
+    }
+    if (it->mode == ECS_EACH_ARCH) { // Every chunk of a matching archetype is one batch
+        for (; it->arch < ecs->arch_count; ++it->arch, it->next = 0) {
+            ecs_arch_t* arch = &ecs->archs[it->arch];
+            if (!CHECK_CMPS(arch->cmps, cmps)) continue;
+            if (!it->next) {
+                it->visited += arch->count;
+                for (cmps_t m = cmps; ANY_CMPS(m); ECS_POP_CMP(m)) view->strides[ECS_LOW_CMP(m)] = ECS_PITCH(&arch->cols[ECS_LOW_CMP(m)]);
+            }
+            size_t k = it->next;
+            if (k >= arch->chunk_count || k << ECS_BLOCK_SHIFT >= arch->count) continue;
+            size_t left = arch->count - (k << ECS_BLOCK_SHIFT);
+            view->count = left < ECS_BLOCK_ENTS ? left : ECS_BLOCK_ENTS;
+            view->ents = (const ent_t*)arch->ents.blocks[k];
+            for (cmps_t m = cmps; ANY_CMPS(m); ECS_POP_CMP(m)) view->cols[ECS_LOW_CMP(m)] = arch->cols[ECS_LOW_CMP(m)].blocks[k];
+            it->next = k + 1;
+            it->matched += view->count;
+            return 1;
+        }
+        return 0;
+    }
+
+    // Table worlds batch runs of consecutive matching indices within a block
+    while (it->next < ecs->ent_count) {
+        size_t i = it->next, start = i;
+        size_t end = (i | ECS_BLOCK_MASK) + 1;
+        if (end > ecs->ent_count) end = ecs->ent_count;
+        if (end > start + ECS_BATCH) end = start + ECS_BATCH;
+        size_t n = 0;
+        for (; i < end && CHECK_CMPS(ECS_REF(cmps_t, &ecs->ent_cmps, i), cmps); ++i) {
+            ecs_slot_t slot = ECS_REF(ecs_slot_t, &ecs->ent_slots, i);
+            if (slot.pos == ECS_DEAD) break; // Only reachable with an empty mask
+            it->ents[n++] = MAKE_ENT(i, slot.gen);
+        }
+        it->next = n ? i : i + 1;
+        if (!n) continue;
+        int lost = 0;
+        for (cmps_t m = cmps; ANY_CMPS(m); ECS_POP_CMP(m)) lost |= ECS_OWN(ecs, &ecs->data[ECS_LOW_CMP(m)], start);
+        if (lost) continue; // Out of memory copying a borrowed block, the run is skipped
+        view->count = n;
+        view->ents = it->ents;
+        for (cmps_t m = cmps; ANY_CMPS(m); ECS_POP_CMP(m)) {
+            view->cols[ECS_LOW_CMP(m)] = ECS_ROW(&ecs->data[ECS_LOW_CMP(m)], start);
+            ECS_DIRTY(ecs, &ecs->data[ECS_LOW_CMP(m)], start);
+        }
+        it->matched += n;
+        return 1;
+    }
     return 0;
 }
+
+//// Run a batch system over contiguous runs of matching entities, returns how many it ran on
+static inline size_t ecs_run_batch(batch_system_t system, void* data, ecs_t* ecs, cmps_t cmps, size_t* visited) {
+    ecs_each_t it;
+    ecs_each_init(&it, ecs, cmps);
+    while (ecs_each_next(&it)) system(ecs, &it.view, data);
+    *visited = it.visited;
+    return it.matched;
+}
+//// Run a batch system over contiguous runs of matching entities
+static inline void run_batch(batch_system_t system, void* data, ecs_t* ecs, cmps_t cmps) {
+    ECS_PROF_BEGIN(ecs);
+    size_t visited = 0, matched = ecs_run_batch(system, data, ecs, cmps, &visited);
+    ECS_PROF_END(ecs, system, "batch", visited, matched);
+}
+
+// Inline systems
+//   EACH(ecs, ent, (type, name, cmp_id), ...) { body } runs body for every
+//   entity holding all the listed components (up to 8), with ent and a
+//   type* per component bound, in run_batch's order. The mask is built from
+//   constants (folded at compile time while MAX_CMPS <= 64, wide masks call
+//   ecs_mask_bit) and the body is inlined into the batch loop, there is no
+//   system call and no cmps() varargs. Pointers are view elements, like
+//   VIEW_CMP: a pooled component binds its blob_t and a tag binds NULL.
+//   A split component has no single element to point at, so it binds a copy
+//   of the entity's, written back after the body (writes to it made other
+//   ways during the body are lost). run_batch with VIEW_FIELD avoids the
+//   copies. break and continue work as in any loop.
+//// ecs_each_init for EACH, noting whether any component is split
+static inline void ecs_each_start(ecs_each_t* it, ecs_t* ecs, cmps_t cmps) {
+    ecs_each_init(it, ecs, cmps);
+    it->split = 0;
+    for (cmps_t m = cmps; ANY_CMPS(m); ECS_POP_CMP(m)) it->split |= ecs->data[ECS_LOW_CMP(m)].lane != 0;
+}
+//// Element k of a component in the current batch, a split one copied whole into tmp
+////   Out of line with ecs_each_put, so EACH loops without split components stay small.
+ECS_COLD void* ecs_each_get(ecs_each_t* it, cmp_t cmp_id, size_t k, void* tmp, size_t size) {
+    uint8_t* row = it->view.cols[cmp_id];
+    if (!row) return NULL; // Tags
+    ecs_col_t* col = &it->ecs->data[cmp_id];
+    if (!col->lane) return row + k * size;
+    size_t at;
+    it->cur = it->view.ents[k];
+    col = ecs_cmp_col(it->ecs, it->cur, cmp_id, &at);
+    ecs_col_read(col, at, 0, tmp, size < col->stride ? size : col->stride);
+    return tmp;
+}
+//// Write a split component's copy back, wherever the body left its entity
+ECS_COLD void ecs_each_put(ecs_each_t* it, cmp_t cmp_id, const void* tmp, size_t size) {
+    ecs_t* ecs = it->ecs;
+    if (!ecs->data[cmp_id].lane || !tmp || !is_alive(ecs, it->cur) || !CHECK_BIT(get_cmps(ecs, it->cur), cmp_id)) return;
+    size_t at;
+    ecs_col_t* col = ecs_cmp_col(ecs, it->cur, cmp_id, &at);
+    if (ECS_OWN(ecs, col, at)) return; // Out of memory copying a borrowed block, the write is lost
+    ECS_DIRTY(ecs, col, at);
+    ecs_col_write(col, at, 0, tmp, size < col->stride ? size : col->stride);
+}
+#define ECS_EACH_ARGS(...) __VA_ARGS__
+#define ECS_EACH_CAT(a, b) ECS_EACH_CAT_(a, b)
+#define ECS_EACH_CAT_(a, b) a##b
+#define ECS_EACH_COUNT(...) ECS_EACH_COUNT_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define ECS_EACH_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define ECS_EACH_APPLY(f, ent, spec) ECS_EACH_APPLY_(f, ent, ECS_EACH_ARGS spec)
+#define ECS_EACH_APPLY_(f, ent, ...) f(ent, __VA_ARGS__)
+// f(ent, type, name, cmp_id) for every spec
+#define ECS_EACH_MAP(f, ent, ...) ECS_EACH_CAT(ECS_EACH_MAP, ECS_EACH_COUNT(__VA_ARGS__))(f, ent, __VA_ARGS__)
+#define ECS_EACH_MAP1(f, ent, s) ECS_EACH_APPLY(f, ent, s)
+#define ECS_EACH_MAP2(f, ent, s, ...) ECS_EACH_APPLY(f, ent, s) ECS_EACH_MAP1(f, ent, __VA_ARGS__)
+#define ECS_EACH_MAP3(f, ent, s, ...) ECS_EACH_APPLY(f, ent, s) ECS_EACH_MAP2(f, ent, __VA_ARGS__)
+#define ECS_EACH_MAP4(f, ent, s, ...) ECS_EACH_APPLY(f, ent, s) ECS_EACH_MAP3(f, ent, __VA_ARGS__)
+#define ECS_EACH_MAP5(f, ent, s, ...) ECS_EACH_APPLY(f, ent, s) ECS_EACH_MAP4(f, ent, __VA_ARGS__)
+#define ECS_EACH_MAP6(f, ent, s, ...) ECS_EACH_APPLY(f, ent, s) ECS_EACH_MAP5(f, ent, __VA_ARGS__)
+#define ECS_EACH_MAP7(f, ent, s, ...) ECS_EACH_APPLY(f, ent, s) ECS_EACH_MAP6(f, ent, __VA_ARGS__)
+#define ECS_EACH_MAP8(f, ent, s, ...) ECS_EACH_APPLY(f, ent, s) ECS_EACH_MAP7(f, ent, __VA_ARGS__)
+#define ECS_EACH_BIT(ent, type, name, cmp_id) | ECS_BIT(cmp_id)
+// One pass loops bind a pointer each, the innermost binds ent and notices a break (its step never runs)
+//   Tags have no column, they bind NULL rather than an offset from it. A split
+//   component binds name##_copy_, written back by the step, which a break runs too.
+#define ECS_EACH_BIND(ent, type, name, cmp_id) \
+    for (type name##_copy_, *name = !ent##_split_ && ent##_each_.view.cols[cmp_id] ? (type*)ent##_each_.view.cols[cmp_id] + ent##_k_ : \
+                                    (type*)ecs_each_get(&ent##_each_, (cmp_id), ent##_k_, &name##_copy_, sizeof(type)); \
+         (void)name, ent##_once_; ent##_once_ = 0, ent##_split_ ? ecs_each_put(&ent##_each_, (cmp_id), name, sizeof(type)) : (void)0)
+//// Mask of the components in EACH specs, a constant while MAX_CMPS <= 64
+#define EACH_CMPS(...) (ECS_NO_CMPS ECS_EACH_MAP(ECS_EACH_BIT, _, __VA_ARGS__))
+#define EACH(ecs, ent, ...) \
+    for (ecs_each_t ent##_each_, *ent##_init_ = (ecs_each_start(&ent##_each_, (ecs), EACH_CMPS(__VA_ARGS__)), &ent##_each_); \
+         ent##_init_ && !ent##_each_.stop && ecs_each_next(&ent##_each_);) \
+        for (size_t ent##_k_ = 0, ent##_brk_ = 0, ent##_once_, ent##_split_ = (size_t)ent##_each_.split; \
+             ent##_brk_ ? (ent##_each_.stop = 1, 0) : (ent##_once_ = 1, ent##_k_ < ent##_each_.view.count); ++ent##_k_) \
+            ECS_EACH_MAP(ECS_EACH_BIND, ent, __VA_ARGS__) \
+            for (ent_t ent = (ent##_brk_ = 1, ent##_each_.view.ents[ent##_k_]); (void)ent, ent##_brk_; ent##_brk_ = 0)
+
+
+/* Threads */
+#if defined(ECS_THREADS)
+
+// Parallel run flags
+#define ECS_PAR_DETERMINISTIC (1u << 0) // Fixed chunk -> worker split, no stealing
+
+// Worker, owns a range of chunks that idle workers steal from the front of
+typedef struct {
+    _Atomic size_t next; // Next chunk to claim
+    size_t end;
+    struct workers_t* pool;
+    size_t id;
+} __attribute__((aligned(64))) ecs_worker_t;
+
+// Persistent worker pool, the calling thread is worker 0
+typedef struct workers_t {
+    size_t count;
+    pthread_t threads[ECS_MAX_THREADS];
+    ecs_worker_t workers[ECS_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    uint64_t job_gen;
+    size_t busy;
+    int quit;
+    void (*job)(struct workers_t*, size_t);
+    void* ctx;
+    match_t match; // Scratch for run_par
+} workers_t;
+
+// Index of the worker running the current system, 0 outside a pool
+static inline size_t worker_id(void) { return ecs_worker_index; }
+
+// Pool
+//// Worker thread, sleeps until a new job generation is posted
+ECS_COLD void* ecs_worker_main(void* arg) {
+    ecs_worker_t* self = (ecs_worker_t*)arg;
+    workers_t* pool = self->pool;
+    ecs_worker_index = self->id;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->job_gen == seen && !pool->quit) pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->quit) break;
+        seen = pool->job_gen;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->job(pool, self->id);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+//// Run a job on every worker, the caller included, and wait for all of them
+ECS_COLD void ecs_workers_exec(workers_t* pool, void (*job)(workers_t*, size_t), void* ctx) {
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->ctx = ctx;
+    pool->busy = pool->count - 1;
+    pool->job_gen++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    job(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+//// Start `count` workers, counting the calling thread
+ECS_COLD int init_workers(workers_t* pool, size_t count) {
+    memset(pool, 0, sizeof(workers_t));
+    if (pthread_mutex_init(&pool->lock, NULL)) return -1;
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    if (count < 1) count = 1;
+    if (count > ECS_MAX_THREADS) count = ECS_MAX_THREADS;
+
+    pool->count = 1;
+    pool->workers[0].pool = pool;
+    for (size_t i = 1; i < count; ++i) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        if (pthread_create(&pool->threads[i], NULL, ecs_worker_main, &pool->workers[i])) break;
+        pool->count = i + 1;
+    }
+    return 0;
+}
+//// Stop and join every worker
+ECS_COLD void deinit_workers(workers_t* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 1; i < pool->count; ++i) pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    free_match(&pool->match);
+}
+
+// Parallel run
+typedef struct {
+    system_t system;
+    void* data;
+    ecs_t* ecs;
+    const ent_t* ents;
+    size_t count;
+    uint32_t flags;
+} ecs_par_t;
+//// Claim chunks from our own range, then steal from the others
+ECS_COLD void ecs_par_job(workers_t* pool, size_t id) {
+    ecs_par_t* par = (ecs_par_t*)pool->ctx;
+    for (size_t v = 0; v < pool->count; ++v) {
+        if (v && (par->flags & ECS_PAR_DETERMINISTIC)) break;
+        ecs_worker_t* victim = &pool->workers[(id + v) % pool->count];
+        for (;;) {
+            size_t chunk = atomic_fetch_add_explicit(&victim->next, 1, memory_order_relaxed);
+            if (chunk >= victim->end) break;
+            size_t end = (chunk + 1) * ECS_PAR_GRAIN < par->count ? (chunk + 1) * ECS_PAR_GRAIN : par->count;
+            for (size_t i = chunk * ECS_PAR_GRAIN; i < end; ++i) par->system(par->ecs, par->ents[i], par->data);
+        }
+    }
+}
+//// Run a system in parallel over every entity containing cmps
+////   Systems may read anything but only write the components of the entity
+////   they are called with. Create, destroy, add and delete go through
+////   per-thread command buffers (cmd_*) and flush_cmds afterwards.
+////   ECS_PAR_DETERMINISTIC pins every chunk to one worker for a given pool
+////   size, so per-worker results are reproducible run to run.
+static inline int run_par(workers_t* pool, system_t system, void* data, ecs_t* ecs, cmps_t cmps, uint32_t flags) {
+    ECS_PROF_BEGIN(ecs);
+    if (match_ents(ecs, cmps, &pool->match)) return -1;
+    ecs_par_t par = { system, data, ecs, pool->match.ents, pool->match.count, flags };
+    if (pool->count == 1) {
+        for (size_t i = 0; i < par.count; ++i) system(ecs, par.ents[i], data);
+        ECS_PROF_END(ecs, system, "par", ANY_CMPS(cmps) ? ecs->ent_count : ecs->active_count, par.count);
+        return 0;
+    }
+
+    size_t chunks = (par.count + ECS_PAR_GRAIN - 1) / ECS_PAR_GRAIN;
+    for (size_t w = 0; w < pool->count; ++w) { // Even contiguous split, stealing evens out the rest
+        atomic_store_explicit(&pool->workers[w].next, chunks * w / pool->count, memory_order_relaxed);
+        pool->workers[w].end = chunks * (w + 1) / pool->count;
+    }
+    ecs_workers_exec(pool, ecs_par_job, &par);
+    ECS_PROF_END(ecs, system, "par", ANY_CMPS(cmps) ? ecs->ent_count : ecs->active_count, par.count); // Matched up front, not rechecked
+    return 0;
+}
+
+#endif // ECS_THREADS
+
+/* Command buffers */
+// Deferred structural operations
+enum { ECS_CMD_CREATE, ECS_CMD_DESTROY, ECS_CMD_ADD, ECS_CMD_DEL };
+typedef struct {
+    ent_t ent;
+    uint32_t seq; // Position in its buffer, assigned at flush
+    uint8_t op;
+    uint8_t buf; // Recording buffer, assigned at flush
+    cmp_t cmp;
+    uint32_t size;
+    size_t data; // Offset into the buffer's data
+} ecs_cmd_t;
+
+// One thread's commands, only ever touched by that thread until the flush
+typedef struct {
+    size_t count, cap;
+    ecs_cmd_t* cmds;
+    size_t bytes, bytes_cap;
+    uint8_t* data;
+    size_t pending; // Handles handed out by cmd_create
+    ent_t* created; // Their real handles, during a flush
+} __attribute__((aligned(64))) ecs_cmd_buf_t;
+
+// Per-thread command buffers, recorded lock-free, applied by flush_cmds
+typedef struct {
+    ecs_cmd_buf_t bufs[ECS_MAX_THREADS];
+    size_t cap;
+    ecs_cmd_t* sorted; // Scratch for the flush
+} cmds_t;
+
+//// The calling thread's buffer
+static inline ecs_cmd_buf_t* ecs_cmd_buf(cmds_t* cmds) {
+#if defined(ECS_THREADS)
+    return &cmds->bufs[worker_id()];
+#else
+    return &cmds->bufs[0];
+#endif
+}
+//// Append a command and `size` bytes of data
+static inline int ecs_cmd_push(ecs_cmd_buf_t* buf, uint8_t op, ent_t ent, cmp_t cmp, const void* data, size_t size) {
+    if (buf->count >= UINT32_MAX || size > UINT32_MAX) return -1;
+    if (buf->count == buf->cap) {
+        size_t cap = buf->cap ? buf->cap * 2 : 64;
+        ecs_cmd_t* cmds = (ecs_cmd_t*)realloc(buf->cmds, cap * sizeof(ecs_cmd_t));
+        if (!cmds) return -1;
+        buf->cmds = cmds;
+        buf->cap = cap;
+    }
+    if (buf->bytes + size > buf->bytes_cap) {
+        size_t cap = buf->bytes_cap ? buf->bytes_cap : 1024;
+        while (cap < buf->bytes + size) cap *= 2;
+        uint8_t* bytes = (uint8_t*)realloc(buf->data, cap);
+        if (!bytes) return -1;
+        buf->data = bytes;
+        buf->bytes_cap = cap;
+    }
+    if (size) memcpy(buf->data + buf->bytes, data, size);
+    buf->cmds[buf->count++] = (ecs_cmd_t){ ent, 0, op, 0, cmp, (uint32_t)size, buf->bytes };
+    buf->bytes += size;
+    return 0;
+}
+
+// Recording, safe from inside systems and from parallel workers
+//// Queue an entity creation, returns a pending handle only valid for this thread's commands
+static inline ent_t cmd_create(cmds_t* cmds) {
+    ecs_cmd_buf_t* buf = ecs_cmd_buf(cmds);
+    if (buf->pending >= ECS_INDEX_MASK) return (ent_t)-1;
+    ent_t ent = MAKE_ENT(buf->pending, ECS_GEN_MASK);
+    if (ecs_cmd_push(buf, ECS_CMD_CREATE, ent, 0, NULL, 0)) return (ent_t)-1;
+    buf->pending++;
+    return ent;
+}
+//// Queue an entity destruction
+static inline int cmd_destroy(cmds_t* cmds, ent_t ent) {
+    return ecs_cmd_push(ecs_cmd_buf(cmds), ECS_CMD_DESTROY, ent, 0, NULL, 0);
+}
+//// Queue a component add, data is copied now
+static inline int cmd_add(cmds_t* cmds, ent_t ent, cmp_t cmp_id, const void* data, size_t size) {
+    if (cmp_id >= MAX_CMPS) return -1;
+    return ecs_cmd_push(ecs_cmd_buf(cmds), ECS_CMD_ADD, ent, cmp_id, data, size);
+}
+//// Queue a component delete
+static inline int cmd_del(cmds_t* cmds, ent_t ent, cmp_t cmp_id) {
+    if (cmp_id >= MAX_CMPS) return -1;
+    return ecs_cmd_push(ecs_cmd_buf(cmds), ECS_CMD_DEL, ent, cmp_id, NULL, 0);
+}
+
+// Flush
+ECS_COLD int ecs_cmd_cmp(const void* a, const void* b) {
+    const ecs_cmd_t* x = (const ecs_cmd_t*)a;
+    const ecs_cmd_t* y = (const ecs_cmd_t*)b;
+    if (x->ent != y->ent) return ENT_INDEX(x->ent) != ENT_INDEX(y->ent)
+                                 ? (ENT_INDEX(x->ent) < ENT_INDEX(y->ent) ? -1 : 1)
+                                 : (x->ent < y->ent ? -1 : 1);
+    if (x->buf != y->buf) return x->buf < y->buf ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+//// Apply one entity's commands as a single structural change
+////   Adds and deletes are folded into the final mask first, so an archetype
+////   entity moves once however many components it gains or loses.
+ECS_COLD int ecs_cmd_apply(ecs_t* ecs, cmds_t* cmds, ecs_cmd_t* cmd, size_t n) {
+    ent_t ent = cmd[0].ent;
+    if (!is_alive(ecs, ent)) return 0; // Destroyed earlier, ignored like destroy_ent does
+    for (size_t k = 0; k < n; ++k) { // Anything before a destroy is moot, anything after is stale
+        if (cmd[k].op == ECS_CMD_DESTROY) { destroy_ent(ecs, ent); return 0; }
+    }
+
+    size_t i = ENT_INDEX(ent);
+    if (ECS_OWN(ecs, &ecs->ent_cmps, i)) return -1;
+    cmps_t old = ECS_REF(cmps_t, &ecs->ent_cmps, i), now = old, written = ECS_NO_CMPS;
+    ecs_cmd_t* last[MAX_CMPS];
+    for (size_t k = 0; k < n; ++k) { // Same rules as add_cmp and del_cmp, one op at a time
+        cmp_t c = cmd[k].cmp;
+        if (cmd[k].op == ECS_CMD_ADD) {
+            if (CHECK_BIT(now, c) || cmd[k].size > (CHECK_BIT(ecs->pooled_cmps, c) ? ECS_POOL_MAX : ecs->cmp_info[c].size)) continue;
+            SET_BIT(now, c);
+            SET_BIT(written, c);
+            last[c] = &cmd[k];
+        } else if (CHECK_BIT(now, c)) {
+            CLEAR_BIT(now, c);
+            CLEAR_BIT(written, c);
+        }
+    }
+    if (SAME_CMPS(now, old) && !ANY_CMPS(written)) return 0;
+
+    cmps_t dropped = old & ecs->pooled_cmps & (~now | written); // Blobs freed, read before rows move
+    uint32_t refs[MAX_CMPS];
+    for (cmps_t m = dropped; ANY_CMPS(m); ECS_POP_CMP(m)) {
+        cmp_t c = ECS_LOW_CMP(m);
+        refs[c] = ((blob_t*)ecs_cmp_at(ecs, ent, c))->ref;
+    }
+    for (cmps_t m = written & ecs->pooled_cmps; ANY_CMPS(m); ECS_POP_CMP(m)) {
+        cmp_t c = ECS_LOW_CMP(m);
+        if (ecs_pool_reserve(ecs->pools[c], ecs_pool_class(last[c]->size, ecs->cmp_info[c].align))) return -1;
+    }
+
+    if (ecs->query_count && ecs_queries_reserve(ecs, ent, 0, 1, old, now)) return -1;
+
+    cmps_t changed = old ^ now;
+    for (cmps_t m = (changed & old) & ecs->sparse_cmps; ANY_CMPS(m); ECS_POP_CMP(m)) { // Forks own what moves first
+        cmp_t c = ECS_LOW_CMP(m);
+        if (ecs_sparse_own(ecs, &ecs->sparse[c], &ecs->data[c], ent)) return -1;
+    }
+    for (cmps_t m = (written & ~changed) & ecs->sparse_cmps; ANY_CMPS(m); ECS_POP_CMP(m)) {
+        cmp_t c = ECS_LOW_CMP(m);
+        if (ECS_OWN(ecs, &ecs->data[c], ECS_REF(uint32_t, &ecs->sparse[c].index, i))) return -1;
+    }
+    for (cmps_t m = changed & ecs->sparse_cmps; ANY_CMPS(m); ECS_POP_CMP(m)) {
+        cmp_t c = ECS_LOW_CMP(m);
+        if (CHECK_BIT(now, c)) {
+            if (ecs_sparse_add(ecs, &ecs->sparse[c], &ecs->data[c], ent) < 0) return -1;
+        } else ecs_sparse_del(ecs, &ecs->sparse[c], &ecs->data[c], ent);
+    }
+    if (ecs->flags & ECS_ARCHETYPES) {
+        if (ANY_CMPS(changed & ~ecs->sparse_cmps)) {
+            int32_t to = (int32_t)ECS_REF(ecs_rec_t, &ecs->ent_recs, i).arch;
+            for (cmps_t m = changed & ~ecs->sparse_cmps; ANY_CMPS(m) && to >= 0; ECS_POP_CMP(m)) {
+                to = ecs_arch_edge(ecs, (uint32_t)to, ECS_LOW_CMP(m));
+            }
+            if (to < 0 || ecs_arch_move(ecs, ent, (uint32_t)to) < 0) return -1;
+        }
+    } else {
+        for (cmps_t m = written & ~ecs->sparse_cmps; ANY_CMPS(m); ECS_POP_CMP(m)) {
+            if (ecs_col_touch(&ecs->data[ECS_LOW_CMP(m)], i, ecs->flags)) return -1;
+        }
+    }
+
+    if (ecs->query_count) ecs_queries_sync(ecs, ent, 1, old, 1, now);
+    ECS_REF(cmps_t, &ecs->ent_cmps, i) = now;
+    ECS_DIRTY(ecs, &ecs->ent_cmps, i);
+    for (cmps_t m = dropped; ANY_CMPS(m); ECS_POP_CMP(m)) {
+        cmp_t c = ECS_LOW_CMP(m);
+        ecs_pool_free(ecs->pools[c], refs[c]);
+    }
+    for (cmps_t m = written; ANY_CMPS(m); ECS_POP_CMP(m)) {
+        cmp_t c = ECS_LOW_CMP(m);
+        ecs_cmd_t* add = last[c];
+        if (CHECK_BIT(ecs->pooled_cmps, c)) {
+            ecs_blob_set(ecs, c, (blob_t*)ecs_cmp_at(ecs, ent, c), cmds->bufs[add->buf].data + add->data, add->size);
+            get_cmp_mut(ecs, ent, c);
+        } else if (add->size && get_cmp_mut(ecs, ent, c)) {
+            size_t at;
+            ecs_col_t* col = ecs_cmp_col(ecs, ent, c, &at);
+            ecs_col_write(col, at, 0, cmds->bufs[add->buf].data + add->data, add->size);
+        }
+        if (CHECK_BIT(ecs->tracked_cmps, c)) ecs_tick_stamp(ecs, i, c, 1);
+    }
+    ECS_PROF_COUNT(ecs, adds, ECS_COUNT_CMPS(written));
+    ECS_PROF_COUNT(ecs, dels, ECS_COUNT_CMPS(old & ~now));
+    return 0;
+}
+//// Apply every queued command and reset the buffers, call with no system running
+////   Creates run first, in record order, then the rest is sorted by entity,
+////   keeping record order, and applied one entity at a time. Pending
+////   handles resolve against the buffer that created them.
+ECS_COLD int flush_cmds(cmds_t* cmds, ecs_t* ecs) {
+    int err = 0;
+    size_t total = 0;
+    for (size_t b = 0; b < ECS_MAX_THREADS; ++b) {
+        ecs_cmd_buf_t* buf = &cmds->bufs[b];
+        total += buf->count;
+        if (!buf->pending) continue;
+        ent_t* created = (ent_t*)realloc(buf->created, buf->pending * sizeof(ent_t));
+        if (!created) return -1;
+        buf->created = created;
+        for (size_t k = 0, p = 0; k < buf->count; ++k) {
+            if (buf->cmds[k].op != ECS_CMD_CREATE) continue;
+            if ((created[p++] = create_ent(ecs)) == (ent_t)-1) err = -1;
+        }
+    }
+    if (total > cmds->cap) {
+        ecs_cmd_t* sorted = (ecs_cmd_t*)realloc(cmds->sorted, total * sizeof(ecs_cmd_t));
+        if (!sorted) return -1;
+        cmds->sorted = sorted;
+        cmds->cap = total;
+    }
+
+    size_t n = 0;
+    for (size_t b = 0; b < ECS_MAX_THREADS; ++b) {
+        ecs_cmd_buf_t* buf = &cmds->bufs[b];
+        for (size_t k = 0; k < buf->count; ++k) {
+            ecs_cmd_t cmd = buf->cmds[k];
+            if (cmd.op == ECS_CMD_CREATE) continue;
+            if (ENT_PENDING(cmd.ent)) {
+                if (ENT_INDEX(cmd.ent) >= buf->pending) { err = -1; continue; }
+                cmd.ent = buf->created[ENT_INDEX(cmd.ent)];
+            }
+            cmd.seq = (uint32_t)k;
+            cmd.buf = (uint8_t)b;
+            cmds->sorted[n++] = cmd;
+        }
+        buf->count = buf->bytes = buf->pending = 0;
+    }
+    qsort(cmds->sorted, n, sizeof(ecs_cmd_t), ecs_cmd_cmp);
+    for (size_t k = 0, end; k < n; k = end) {
+        for (end = k + 1; end < n && cmds->sorted[end].ent == cmds->sorted[k].ent; ++end) {}
+        err |= ecs_cmd_apply(ecs, cmds, &cmds->sorted[k], end - k);
+    }
+    return err ? -1 : 0;
+}
+//// Release a command buffer set
+ECS_COLD void free_cmds(cmds_t* cmds) {
+    for (size_t b = 0; b < ECS_MAX_THREADS; ++b) {
+        free(cmds->bufs[b].cmds);
+        free(cmds->bufs[b].data);
+        free(cmds->bufs[b].created);
+    }
+    free(cmds->sorted);
+    memset(cmds, 0, sizeof(cmds_t));
+}
+
+/* Scheduler */
+// Scheduled system, with the components it iterates, reads and writes
+typedef struct {
+    system_t system;
+    batch_system_t batch; // Instead of system, run with run_batch
+    query_t* query; // Instead of cmps, run with run_query
+    void* data;
+    cmps_t cmps;
+    cmps_t reads;
+    cmps_t writes;
+    uint32_t flags;
+} sched_sys_t;
+
+// Scheduled system flags
+#define ECS_SYS_PAR (1u << 0) // Alone in its wave, split its entities across the pool under run_par's contract
+
+// Systems grouped into waves, no two systems in a wave conflict
+typedef struct {
+    size_t count;
+    sched_sys_t systems[ECS_MAX_SYSTEMS];
+    size_t wave_count;
+    size_t wave_start[ECS_MAX_SYSTEMS + 1];
+    uint16_t order[ECS_MAX_SYSTEMS]; // System ids, wave by wave
+    int built;
+    cmds_t* cmds; // Optional, flushed after every wave
+#if defined(ECS_THREADS)
+    workers_t* pool; // Optional, waves run serially without one
+    _Atomic size_t next;
+    size_t wave;
+    ecs_t* ecs;
+#endif
+} sched_t;
+
+#define ECS_ALL_CMPS (~ECS_NO_CMPS) // Reads or writes of every component, e.g. for structural systems
+
+//// Add a system, in frame order, returns its id or -1
+////   Conflicting systems (one writes what the other reads or writes) keep
+////   their registration order, every other pair may run concurrently.
+static inline int add_system(sched_t* sched, system_t system, void* data, cmps_t cmps, cmps_t reads, cmps_t writes) {
+    if (sched->count >= ECS_MAX_SYSTEMS) return -1;
+    sched->systems[sched->count] = (sched_sys_t){ system, NULL, NULL, data, cmps, reads, writes, 0 };
+    sched->built = 0;
+    return (int)sched->count++;
+}
+//// Add a batch system
+static inline int add_batch_system(sched_t* sched, batch_system_t batch, void* data, cmps_t cmps, cmps_t reads, cmps_t writes) {
+    int id = add_system(sched, NULL, data, cmps, reads, writes);
+    if (id >= 0) sched->systems[id].batch = batch;
+    return id;
+}
+//// Add a system over a cached query
+static inline int add_query_system(sched_t* sched, system_t system, void* data, query_t* query, cmps_t reads, cmps_t writes) {
+    int id = add_system(sched, system, data, query->cmps, reads, writes);
+    if (id >= 0) sched->systems[id].query = query;
+    return id;
+}
+//// Set the ECS_SYS_* flags of a system, returns -1 for an unknown id
+static inline int set_system_flags(sched_t* sched, int id, uint32_t flags) {
+    if (id < 0 || (size_t)id >= sched->count) return -1;
+    sched->systems[id].flags = flags;
+    return 0;
+}
+//// Run one scheduled system
+static inline void ecs_sched_run(sched_sys_t* sys, ecs_t* ecs) {
+    if (sys->batch) run_batch(sys->batch, sys->data, ecs, sys->cmps);
+    else if (sys->query) run_query(sys->system, sys->data, ecs, sys->query);
+    else run(sys->system, sys->data, ecs, sys->cmps);
+}
+
+//// Build the conflict graph and level it into waves
+ECS_COLD void build_sched(sched_t* sched) {
+    size_t level[ECS_MAX_SYSTEMS];
+    sched->wave_count = 0;
+    for (size_t j = 0; j < sched->count; ++j) {
+        sched_sys_t* b = &sched->systems[j];
+        level[j] = 0;
+        for (size_t i = 0; i < j; ++i) { // One wave after the latest conflicting predecessor
+            sched_sys_t* a = &sched->systems[i];
+            if ((ANY_CMPS(a->writes & (b->reads | b->writes)) || ANY_CMPS(b->writes & a->reads)) && level[i] + 1 > level[j]) level[j] = level[i] + 1;
+        }
+        if (level[j] + 1 > sched->wave_count) sched->wave_count = level[j] + 1;
+    }
+
+    size_t n = 0;
+    for (size_t w = 0; w < sched->wave_count; ++w) { // Counting sort, stable in registration order
+        sched->wave_start[w] = n;
+        for (size_t j = 0; j < sched->count; ++j) {
+            if (level[j] == w) sched->order[n++] = (uint16_t)j;
+        }
+    }
+    sched->wave_start[sched->wave_count] = n;
+    sched->built = 1;
+}
+
+#if defined(ECS_THREADS)
+//// Claim systems of the current wave until none are left
+ECS_COLD void ecs_sched_job(workers_t* pool, size_t id) {
+    (void)id;
+    sched_t* sched = (sched_t*)pool->ctx;
+    size_t end = sched->wave_start[sched->wave + 1];
+    for (;;) {
+        size_t i = sched->wave_start[sched->wave] + atomic_fetch_add_explicit(&sched->next, 1, memory_order_relaxed);
+        if (i >= end) break;
+        ecs_sched_run(&sched->systems[sched->order[i]], sched->ecs);
+    }
+}
+#endif
+
+//// Run one wave, on the pool when there is one
+static inline void ecs_sched_wave(sched_t* sched, ecs_t* ecs, size_t w) {
+    size_t start = sched->wave_start[w], count = sched->wave_start[w + 1] - start;
+#if defined(ECS_THREADS)
+    if (sched->pool && sched->pool->count > 1) {
+        sched_sys_t* lone = &sched->systems[sched->order[start]];
+        if (count == 1) { // Alone, split across the pool when it opted in, else serial
+            if ((lone->flags & ECS_SYS_PAR) && !lone->batch && !lone->query) run_par(sched->pool, lone->system, lone->data, ecs, lone->cmps, 0);
+            else ecs_sched_run(lone, ecs);
+            return;
+        }
+        sched->wave = w;
+        sched->ecs = ecs;
+        atomic_store_explicit(&sched->next, 0, memory_order_relaxed);
+        ecs_workers_exec(sched->pool, ecs_sched_job, sched);
+        return;
+    }
+#endif
+    for (size_t i = start; i < start + count; ++i) ecs_sched_run(&sched->systems[sched->order[i]], ecs);
+}
+//// Run every system once, wave by wave
+////   Systems sharing a wave run concurrently: no writes outside their declared
+////   set, structural changes go through sched->cmds. A system alone in its
+////   wave runs serially, unless flagged ECS_SYS_PAR.
+static inline void run_sched(sched_t* sched, ecs_t* ecs) {
+    if (!sched->built) build_sched(sched);
+    for (size_t w = 0; w < sched->wave_count; ++w) {
+        ecs_sched_wave(sched, ecs, w);
+        if (sched->cmds) flush_cmds(sched->cmds, ecs);
+    }
+}
+
+// Serialization
+//   Native byte order: a header, the live entities and their masks, the free
+//   list, then each component's data for the entities that have it, in
+//   active list order (pooled ones as a 32-bit size and that many bytes),
+//   and an FNV-1a checksum of everything before it.
+#define ECS_SAVE_MAGIC 0x57534345u // "ECSW"
+#define ECS_SAVE_VERSION 2u
+#ifndef ECS_STREAM_BUF
+#define ECS_STREAM_BUF 16384 /* Bytes buffered by the save/load streams */
+#endif
+
+// Stream callbacks, return 0 once all `size` bytes are written or read
+typedef int (*ecs_write_t)(const void* data, size_t size, void* ctx);
+typedef int (*ecs_read_t)(void* data, size_t size, void* ctx);
+
+typedef struct {
+    uint32_t magic, version;
+    uint32_t index_bits; // Handle layout of the saving build
+    uint32_t mask_bytes;
+    uint32_t cmp_count; // cmp_info_t records that follow
+    uint32_t flags; // Saving world's flags, informational
+    uint64_t ent_count, active_count, free_count;
+} ecs_save_header_t;
+
+// Buffered stream with a running checksum
+typedef struct {
+    ecs_write_t write;
+    ecs_read_t read;
+    void* ctx;
+    uint64_t sum;
+    size_t pos, len;
+    int err;
+    uint8_t buf[ECS_STREAM_BUF];
+} ecs_stream_t;
+
+static inline uint64_t ecs_fnv(uint64_t sum, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) sum = (sum ^ data[i]) * 0x100000001B3ULL;
+    return sum;
+}
+ECS_COLD void ecs_stream_flush(ecs_stream_t* s) {
+    if (s->pos && !s->err && s->write(s->buf, s->pos, s->ctx)) s->err = -1;
+    s->pos = 0;
+}
+static inline void ecs_stream_put(ecs_stream_t* s, const void* data, size_t size) {
+    s->sum = ecs_fnv(s->sum, (const uint8_t*)data, size);
+    if (s->pos + size > ECS_STREAM_BUF) {
+        ecs_stream_flush(s);
+        if (size > ECS_STREAM_BUF) { // Large writes go straight through
+            if (!s->err && s->write(data, size, s->ctx)) s->err = -1;
+            return;
+        }
+    }
+    memcpy(s->buf + s->pos, data, size);
+    s->pos += size;
+}
+static inline void ecs_stream_get(ecs_stream_t* s, void* data, size_t size) {
+    uint8_t* out = (uint8_t*)data;
+    for (size_t left = size; left && !s->err;) {
+        if (s->pos == s->len) { // Refill, never past what the caller asked for plus one buffer
+            size_t want = left < ECS_STREAM_BUF ? left : ECS_STREAM_BUF;
+            if (s->read(s->buf, want, s->ctx)) { s->err = -1; break; }
+            s->pos = 0;
+            s->len = want;
+        }
+        size_t n = s->len - s->pos < left ? s->len - s->pos : left;
+        memcpy(out, s->buf + s->pos, n);
+        s->pos += n;
+        out += n;
+        left -= n;
+    }
+    if (s->err) memset(data, 0, size);
+    else s->sum = ecs_fnv(s->sum, (const uint8_t*)data, size);
+}
+
+//// Active positions of the entities holding each component, in active order
+////   counts gets every component's count, tags included. Components with data
+////   get list[offsets[c]] onwards, so streaming a column never rescans the world.
+ECS_COLD uint32_t* ecs_cmp_lists(ecs_t* ecs, uint64_t* counts, size_t* offsets) {
+    memset(counts, 0, MAX_CMPS * sizeof(uint64_t));
+    for (size_t k = 0; k < ecs->active_count; ++k) {
+        for (cmps_t m = ECS_REF(cmps_t, &ecs->ent_cmps, ENT_INDEX(ECS_REF(ent_t, &ecs->active_list, k))); ANY_CMPS(m); ECS_POP_CMP(m)) {
+            counts[ECS_LOW_CMP(m)]++;
+        }
+    }
+    size_t total = 0;
+    for (cmp_t c = 0; c < MAX_CMPS; ++c) {
+        offsets[c] = total;
+        if (ecs->cmp_info[c].size) total += counts[c];
+    }
+    uint32_t* list = (uint32_t*)malloc((total ? total : 1) * sizeof(uint32_t));
+    if (!list) return NULL;
+    for (size_t k = 0; k < ecs->active_count; ++k) { // offsets end up one past each list, put back below
+        cmps_t m = ECS_REF(cmps_t, &ecs->ent_cmps, ENT_INDEX(ECS_REF(ent_t, &ecs->active_list, k))) & ~ecs->tag_cmps;
+        for (; ANY_CMPS(m); ECS_POP_CMP(m)) list[offsets[ECS_LOW_CMP(m)]++] = (uint32_t)k;
+    }
+    for (cmp_t c = 0; c < MAX_CMPS; ++c) if (ecs->cmp_info[c].size) offsets[c] -= counts[c];
+    return list;
+}
+
+//// Save through a write callback, any storage mode
+ECS_COLD int save_ecs_stream(ecs_t* ecs, ecs_write_t write, void* ctx) {
+    if (!ecs || !write) return -1;
+    ecs_stream_t* s = (ecs_stream_t*)calloc(1, sizeof(ecs_stream_t));
+    if (!s) return -1;
+    s->write = write;
+    s->ctx = ctx;
+    s->sum = 0xCBF29CE484222325ULL;
+
+    ecs_save_header_t header = { ECS_SAVE_MAGIC, ECS_SAVE_VERSION, ECS_INDEX_BITS, sizeof(cmps_t), MAX_CMPS,
+                                 ecs->flags, ecs->ent_count, ecs->active_count, ecs->free_count };
+    ecs_stream_put(s, &header, sizeof(header));
+    ecs_stream_put(s, ecs->cmp_info, sizeof(ecs->cmp_info));
+    for (size_t k = 0; k < ecs->active_count; ++k) ecs_stream_put(s, &ECS_REF(ent_t, &ecs->active_list, k), sizeof(ent_t));
+    for (size_t k = 0; k < ecs->active_count; ++k) {
+        ecs_stream_put(s, &ECS_REF(cmps_t, &ecs->ent_cmps, ENT_INDEX(ECS_REF(ent_t, &ecs->active_list, k))), sizeof(cmps_t));
+    }
+    for (size_t k = 0; k < ecs->free_count; ++k) { // As handles, so stale handles stay stale
+        size_t i = ECS_REF(ent_t, &ecs->free_list, k);
+        ent_t ent = MAKE_ENT(i, ECS_REF(ecs_slot_t, &ecs->ent_slots, i).gen);
+        ecs_stream_put(s, &ent, sizeof(ent_t));
+    }
+
+    uint64_t counts[MAX_CMPS];
+    size_t offsets[MAX_CMPS];
+    uint32_t* list = ecs_cmp_lists(ecs, counts, offsets);
+    if (!list) s->err = -1;
+    for (cmp_t c = 0; c < MAX_CMPS && !s->err; ++c) {
+        ecs_stream_put(s, &counts[c], sizeof(uint64_t));
+        if (!counts[c] || !ecs->cmp_info[c].size) continue; // Tags are all in the masks
+        for (size_t j = 0; j < counts[c]; ++j) {
+            ent_t ent = ECS_REF(ent_t, &ecs->active_list, list[offsets[c] + j]);
+            if (CHECK_BIT(ecs->pooled_cmps, c)) {
+                const blob_t* blob = (const blob_t*)ecs_cmp_at(ecs, ent, c);
+                ecs_stream_put(s, &blob->size, sizeof(uint32_t));
+                ecs_stream_put(s, blob_data(ecs, c, blob), blob->size);
+            } else {
+                size_t i;
+                ecs_col_t* col = ecs_cmp_col(ecs, ent, c, &i);
+                for (size_t o = 0, n; o < ecs->cmp_info[c].size; o += n) { // A lane at a time when split
+                    n = ecs_col_span(col, o) < ecs->cmp_info[c].size - o ? ecs_col_span(col, o) : ecs->cmp_info[c].size - o;
+                    ecs_stream_put(s, ecs_col_byte(col, i, o), n);
+                }
+            }
+        }
+    }
+    free(list);
+    uint64_t sum = s->sum;
+    ecs_stream_put(s, &sum, sizeof(sum));
+    ecs_stream_flush(s);
+    int err = s->err;
+    free(s);
+    return err ? -1 : 0;
+}
+
+//// Read the k-th saved handle into its slot, which holds gen + 1 until every index is seen once
+////   Handles are re-encoded for this build's index bits.
+static inline int ecs_load_slot(ecs_t* ecs, ecs_stream_t* s, ecs_save_header_t* h, size_t k) {
+    ent_t saved;
+    ecs_stream_get(s, &saved, sizeof(ent_t));
+    size_t i = h->index_bits < 32 ? saved & (ent_t)((1ULL << h->index_bits) - 1) : saved;
+    if (i >= h->ent_count || ECS_REF(ecs_slot_t, &ecs->ent_slots, i).gen) return -1; // Out of range or seen twice
+    ent_t gen = (ent_t)((uint64_t)saved >> h->index_bits) % ECS_GEN_MASK;
+    ECS_REF(ecs_slot_t, &ecs->ent_slots, i) = (ecs_slot_t){ gen + 1, k < h->active_count ? (uint32_t)k : ECS_DEAD };
+    if (k < h->active_count) ECS_REF(ent_t, &ecs->active_list, k) = MAKE_ENT(i, gen);
+    else ECS_REF(ent_t, &ecs->free_list, k - h->active_count) = (ent_t)i;
+    return 0;
+}
+//// Read a pooled component's size and bytes into a fresh slot
+static inline int ecs_load_blob(ecs_t* ecs, ecs_stream_t* s, ent_t ent, cmp_t cmp_id) {
+    uint32_t size = 0;
+    ecs_stream_get(s, &size, sizeof(uint32_t));
+    if (s->err || size > ECS_POOL_MAX || ecs_pool_reserve(ecs->pools[cmp_id], ecs_pool_class(size, ecs->cmp_info[cmp_id].align))) return -1;
+    blob_t* blob = (blob_t*)ecs_cmp_at(ecs, ent, cmp_id);
+    ecs_blob_set(ecs, cmp_id, blob, NULL, size);
+    ecs_stream_get(s, blob_data(ecs, cmp_id, blob), size);
+    return 0;
+}
+//// Rebuild entity tables and storage placement from a stream
+ECS_COLD int ecs_load_body(ecs_t* ecs, ecs_stream_t* s, ecs_save_header_t* h) {
+    if (h->magic != ECS_SAVE_MAGIC || h->version != ECS_SAVE_VERSION || h->mask_bytes != sizeof(cmps_t) ||
+        !h->index_bits || h->index_bits > 32 || h->cmp_count > ECS_MASK_BITS ||
+        h->active_count + h->free_count != h->ent_count || h->ent_count > ECS_INDEX_MASK) return -1;
+
+    cmp_info_t info[ECS_MASK_BITS];
+    ecs_stream_get(s, info, h->cmp_count * sizeof(cmp_info_t));
+    if (s->err || init_ecs(ecs, h->ent_count, ecs->flags)) return -1;
+    for (cmp_t c = 0; c < h->cmp_count && c < MAX_CMPS; ++c) {
+        if ((info[c].size || (info[c].flags & ECS_CMP_TAG)) && register_cmp(ecs, c, info[c].size, info[c].align, info[c].flags)) return -1;
+    }
+
+    // Active handles, their masks, then the free list
+    cmps_t valid = ECS_NO_CMPS;
+    for (cmp_t c = 0; c < MAX_CMPS; ++c) SET_BIT(valid, c);
+    for (size_t k = 0; k < h->active_count && !s->err; ++k) {
+        if (ecs_load_slot(ecs, s, h, k)) return -1;
+    }
+    for (size_t k = 0; k < h->active_count && !s->err; ++k) {
+        cmps_t mask;
+        ecs_stream_get(s, &mask, sizeof(cmps_t));
+        if (ANY_CMPS(mask & ~valid)) return -1;
+        ECS_REF(cmps_t, &ecs->ent_cmps, ENT_INDEX(ECS_REF(ent_t, &ecs->active_list, k))) = mask;
+    }
+    for (size_t k = h->active_count; k < h->ent_count && !s->err; ++k) {
+        if (ecs_load_slot(ecs, s, h, k)) return -1;
+    }
+    if (s->err) return -1;
+    for (size_t i = 0; i < h->ent_count; ++i) ECS_REF(ecs_slot_t, &ecs->ent_slots, i).gen--;
+    ecs->ent_count = h->ent_count;
+    ecs->active_count = h->active_count;
+    ecs->free_count = h->free_count;
+
+    // Place every entity in its storage before any data arrives
+    for (size_t k = 0; k < ecs->active_count; ++k) {
+        ent_t ent = ECS_REF(ent_t, &ecs->active_list, k);
+        cmps_t mask = ECS_REF(cmps_t, &ecs->ent_cmps, ENT_INDEX(ent));
+        for (cmps_t m = mask & ecs->sparse_cmps; ANY_CMPS(m); ECS_POP_CMP(m)) {
+            cmp_t c = ECS_LOW_CMP(m);
+            if (ecs_sparse_add(ecs, &ecs->sparse[c], &ecs->data[c], ent) < 0) return -1;
+        }
+        if (ecs->flags & ECS_ARCHETYPES) {
+            int32_t a = ecs_arch_get(ecs, mask & ~ecs->sparse_cmps);
+            if (a < 0 || ecs_arch_push(ecs, (uint32_t)a, ent) < 0) return -1;
+        } else {
+            for (cmps_t m = mask & ~ecs->sparse_cmps; ANY_CMPS(m); ECS_POP_CMP(m)) {
+                if (ecs_col_touch(&ecs->data[ECS_LOW_CMP(m)], ENT_INDEX(ent), ecs->flags)) return -1;
+            }
+        }
+    }
+
+    uint64_t counts[MAX_CMPS];
+    size_t offsets[MAX_CMPS];
+    uint32_t* list = ecs_cmp_lists(ecs, counts, offsets);
+    if (!list) return -1;
+    int err = 0;
+    for (cmp_t c = 0; c < h->cmp_count && !s->err && !err; ++c) {
+        uint64_t count;
+        ecs_stream_get(s, &count, sizeof(uint64_t));
+        if (count != (c < MAX_CMPS ? counts[c] : 0)) { err = -1; break; }
+        if (!count || !info[c].size) continue;
+        for (size_t j = 0; j < count && !s->err; ++j) {
+            ent_t ent = ECS_REF(ent_t, &ecs->active_list, list[offsets[c] + j]);
+            if (CHECK_BIT(ecs->pooled_cmps, c)) { if ((err = ecs_load_blob(ecs, s, ent, c))) break; }
+            else {
+                size_t i;
+                ecs_col_t* col = ecs_cmp_col(ecs, ent, c, &i);
+                for (size_t o = 0, n; o < info[c].size; o += n) {
+                    n = ecs_col_span(col, o) < info[c].size - o ? ecs_col_span(col, o) : info[c].size - o;
+                    ecs_stream_get(s, ecs_col_byte(col, i, o), n);
+                }
+            }
+        }
+    }
+    free(list);
+    if (err) return -1;
+    uint64_t sum = s->sum, saved = 0;
+    ecs_stream_get(s, &saved, sizeof(saved));
+    return s->err || saved != sum ? -1 : 0;
+}
+//// Load through a read callback, into a world of any storage mode
+////   The world is reset first, keeping its flags and queries. On failure it
+////   is left empty. Mapped worlds are already their own file.
+ECS_COLD int load_ecs_stream(ecs_t* ecs, ecs_read_t read, void* ctx) {
+    if (!ecs || !read || (ecs->flags & ECS_MAPPED)) return -1;
+    ecs_stream_t* s = (ecs_stream_t*)calloc(1, sizeof(ecs_stream_t));
+    if (!s) return -1;
+    s->read = read;
+    s->ctx = ctx;
+    s->sum = 0xCBF29CE484222325ULL;
+
+    uint32_t flags = ecs->flags & ~(ECS_SNAPSHOTS | ECS_FORKED); // Old snapshots no longer apply, nothing is borrowed
+    size_t query_count = ecs->query_count; // Queries survive a load and are refilled
+    query_t** queries = ecs->queries;
+    ecs->query_count = 0;
+    ecs->queries = NULL;
+    deinit_ecs(ecs);
+    ecs->flags = flags;
+
+    ecs_save_header_t header;
+    ecs_stream_get(s, &header, sizeof(header));
+    int err = s->err || ecs_load_body(ecs, s, &header);
+    free(s);
+    if (err) {
+        deinit_ecs(ecs);
+        init_ecs(ecs, 0, flags);
+    }
+    ecs->query_count = query_count;
+    ecs->queries = queries;
+    for (size_t q = 0; q < query_count; ++q) err |= ecs_query_fill(ecs, queries[q]);
+    for (size_t k = 0; k < ecs->active_count && ANY_CMPS(ecs->tracked_cmps); ++k) { // Everything loaded counts as added
+        size_t i = ENT_INDEX(ECS_REF(ent_t, &ecs->active_list, k));
+        for (cmps_t m = ECS_REF(cmps_t, &ecs->ent_cmps, i) & ecs->tracked_cmps; ANY_CMPS(m); ECS_POP_CMP(m)) {
+            ecs_tick_stamp(ecs, i, ECS_LOW_CMP(m), 1);
+        }
+    }
+    return err ? -1 : 0;
+}
+
+static inline int ecs_file_write(const void* data, size_t size, void* file) { return fwrite(data, size, 1, (FILE*)file) == 1 ? 0 : -1; }
+static inline int ecs_file_read(void* data, size_t size, void* file) { return fread(data, size, 1, (FILE*)file) == 1 ? 0 : -1; }
+//// Save
+static inline int save_ecs(ecs_t* ecs, const char* filename) {
+    if (!ecs || !filename) return -1;
+    FILE* file = fopen(filename, "wb");
+    if (!file) return -1;
+    int err = save_ecs_stream(ecs, ecs_file_write, file);
+    return fclose(file) || err ? -1 : 0;
+}
 //// Load
 static inline int load_ecs(ecs_t* ecs, const char* filename) {
     if (!ecs || !filename) return -1;
-
     FILE* file = fopen(filename, "rb");
     if (!file) return -1;
-
-    fread(ecs, sizeof(ecs_t), 1, file);
+    int err = load_ecs_stream(ecs, ecs_file_read, file);
     fclose(file);
+    return err;
+}
+
+// Mapped worlds
+//   The file is a header page then every column at a fixed offset, computed
+//   from the capacity and component registry alone, so it holds no pointers.
+//   Block tables are rebuilt over the mapping on open and pages fault in on
+//   first access.
+#define ECS_MAP_MAGIC 0x4D534345u // "ECSM"
+#define ECS_MAP_VERSION 1u
+#define ECS_MAP_ALIGN ((size_t)4096)
+
+typedef struct {
+    uint32_t magic, version;
+    uint32_t index_bits, block_shift, mask_bytes, max_cmps; // Build layout, must match
+    uint64_t capacity, map_len;
+    uint64_t free_count, active_count, ent_count; // As of the last checkpoint or close
+    uint64_t sparse_counts[MAX_CMPS];
+    cmp_info_t cmp_info[MAX_CMPS];
+} ecs_map_header_t;
+
+//// Point a column's block table at `len` bytes of the mapping from *offset
+ECS_COLD int ecs_map_col(ecs_t* ecs, ecs_col_t* col, size_t* offset) {
+    size_t blocks = ecs->capacity >> ECS_BLOCK_SHIFT, bytes = col->stride << ECS_BLOCK_SHIFT;
+    if (ecs->map) {
+        if (!(col->blocks = (uint8_t**)malloc(blocks * sizeof(uint8_t*)))) return -1;
+        for (size_t b = 0; b < blocks; ++b) col->blocks[b] = bytes ? ecs->map + *offset + b * bytes : NULL; // Tags take no space
+        col->block_count = blocks;
+    }
+    *offset += (blocks * bytes + ECS_MAP_ALIGN - 1) & ~(ECS_MAP_ALIGN - 1);
+    return 0;
+}
+//// Drop a column's block table, its blocks go with the mapping
+ECS_COLD int ecs_map_forget(ecs_t* ecs, ecs_col_t* col, size_t* offset) {
+    (void)ecs; (void)offset;
+    free(col->blocks);
+    col->blocks = NULL;
+    col->block_count = 0;
+    return 0;
+}
+//// Visit every mapped column in file order, the total length ends up in len
+ECS_COLD int ecs_map_cols(ecs_t* ecs, size_t* len, int (*visit)(ecs_t*, ecs_col_t*, size_t*)) {
+    size_t offset = (sizeof(ecs_map_header_t) + ECS_MAP_ALIGN - 1) & ~(ECS_MAP_ALIGN - 1);
+    int err = visit(ecs, &ecs->free_list, &offset)
+           || visit(ecs, &ecs->active_list, &offset)
+           || visit(ecs, &ecs->ent_slots, &offset)
+           || visit(ecs, &ecs->ent_cmps, &offset);
+    for (size_t c = 0; c < MAX_CMPS && !err; ++c) {
+        err = visit(ecs, &ecs->data[c], &offset);
+        if (!err && CHECK_BIT(ecs->sparse_cmps, c)) {
+            err = visit(ecs, &ecs->sparse[c].dense, &offset)
+               || visit(ecs, &ecs->sparse[c].index, &offset);
+        }
+    }
+    *len = offset;
+    return err;
+}
+//// Grow a file to len bytes of holes by writing its last byte
+////   ftruncate would do, but is hidden under -std=c11 when another header
+////   set the feature macros first. lseek, read and write never are.
+#if defined(MAP_SHARED)
+ECS_COLD int ecs_file_extend(int fd, size_t len) {
+    return !len || lseek(fd, (off_t)(len - 1), SEEK_SET) < 0 || write(fd, "", 1) != 1 ? -1 : 0;
+}
+#endif
+//// Write the counters back to the header
+ECS_COLD void ecs_map_store(ecs_t* ecs) {
+    ecs_map_header_t* header = (ecs_map_header_t*)ecs->map;
+    header->free_count = ecs->free_count;
+    header->active_count = ecs->active_count;
+    header->ent_count = ecs->ent_count;
+    for (size_t c = 0; c < MAX_CMPS; ++c) header->sparse_counts[c] = ecs->sparse[c].count;
+}
+//// Store the counters and unmap, block tables are dropped without freeing
+ECS_COLD void ecs_map_close(ecs_t* ecs) {
+    if (!ecs->map) return;
+    ecs_map_store(ecs);
+#if defined(MAP_SHARED)
+    munmap(ecs->map, ecs->map_len);
+#endif
+    size_t len;
+    ecs_map_cols(ecs, &len, ecs_map_forget);
+    ecs->map = NULL;
+}
+
+//// Map a world from a file, creating it with room for `capacity` entities if missing
+////   Register components on the zero-initialized world first. An existing
+////   file must match that registry (or the world registers nothing) and this
+////   build's layout. Table and sparse storage only, the capacity is fixed.
+////   Change ticks of tracked components live in memory and start over with
+////   each mapping.
+ECS_COLD int map_ecs(ecs_t* ecs, const char* filename, size_t capacity) {
+#if defined(MAP_SHARED)
+    if (!ecs || !filename || (ecs->flags & (ECS_ARCHETYPES | ECS_MAPPED | ECS_FORKED)) || ecs->active_count) return -1;
+    int registered = ecs->ent_cmps.stride != 0;
+    if (!registered && ecs_grow(ecs, 0)) return -1;
+    cmp_info_t info[MAX_CMPS];
+    memcpy(info, ecs->cmp_info, sizeof(info));
+
+    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    struct stat st;
+    ecs_map_header_t header;
+    int fresh = fstat(fd, &st) == 0 && st.st_size == 0;
+    if (fresh && !capacity) { // Nothing could ever be created in it
+        close(fd);
+        return -1;
+    }
+    if (fresh) {
+        header = (ecs_map_header_t){ .magic = ECS_MAP_MAGIC, .version = ECS_MAP_VERSION, .index_bits = ECS_INDEX_BITS,
+                                     .block_shift = ECS_BLOCK_SHIFT, .mask_bytes = sizeof(cmps_t), .max_cmps = MAX_CMPS,
+                                     .capacity = (capacity + ECS_BLOCK_MASK) & ~(size_t)ECS_BLOCK_MASK };
+        memcpy(header.cmp_info, info, sizeof(info));
+    } else if (read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) || // Just opened, at offset 0
+               header.magic != ECS_MAP_MAGIC || header.version != ECS_MAP_VERSION ||
+               header.index_bits != ECS_INDEX_BITS || header.block_shift != ECS_BLOCK_SHIFT ||
+               header.mask_bytes != sizeof(cmps_t) || header.max_cmps != MAX_CMPS ||
+               header.map_len != (uint64_t)st.st_size || (registered && memcmp(header.cmp_info, info, sizeof(info)))) {
+        close(fd);
+        return -1;
+    }
+    for (size_t c = 0; c < MAX_CMPS; ++c) { // Same rules as register_cmp, pool slabs cannot live in the file
+        cmp_info_t ci = header.cmp_info[c];
+        if ((!ci.size && !(ci.flags & ECS_CMP_TAG)) || (ci.flags & ECS_CMP_POOLED) || !ci.align || (ci.align & (ci.align - 1)) || ci.align > 64) { close(fd); return -1; }
+    }
+
+    // Rebuild the world around the file's registry, then size or map it
+    uint32_t flags = (ecs->flags & ~ECS_HUGE_PAGES) | ECS_MAPPED;
+    size_t query_count = ecs->query_count;
+    query_t** queries = ecs->queries;
+    ecs->query_count = 0;
+    ecs->queries = NULL;
+    deinit_ecs(ecs);
+    memcpy(ecs->cmp_info, header.cmp_info, sizeof(info));
+    ecs->flags = flags;
+    ecs->capacity = header.capacity;
+    ecs->free_list.stride = ecs->active_list.stride = sizeof(ent_t);
+    ecs->ent_slots.stride = sizeof(ecs_slot_t);
+    ecs->ent_cmps.stride = sizeof(cmps_t);
+    ecs->ent_recs.stride = sizeof(ecs_rec_t);
+    for (size_t c = 0; c < MAX_CMPS; ++c) {
+        cmp_info_t ci = header.cmp_info[c];
+        ecs->data[c].stride = (ci.size + ci.align - 1) & ~(size_t)(ci.align - 1);
+        ecs->data[c].lane = (ci.flags & ECS_CMP_SPLIT) ? ci.align : 0;
+        ecs->sparse[c].dense.stride = sizeof(ent_t);
+        ecs->sparse[c].index.stride = sizeof(uint32_t);
+        ecs->ticks[c].stride = sizeof(ecs_tick_t);
+        if (ci.flags & ECS_CMP_SPARSE) SET_BIT(ecs->sparse_cmps, c);
+        if (ci.flags & ECS_CMP_TAG) SET_BIT(ecs->tag_cmps, c);
+        if (ci.flags & ECS_CMP_TRACKED) SET_BIT(ecs->tracked_cmps, c);
+    }
+
+    size_t len;
+    int err = ecs_map_cols(ecs, &len, ecs_map_col) || (fresh && ecs_file_extend(fd, len)); // Fresh files are all holes
+    if (!err && !fresh && len != header.map_len) err = -1;
+    void* map = err ? MAP_FAILED : mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ecs->flags &= ~ECS_MAPPED;
+        deinit_ecs(ecs);
+        ecs->query_count = query_count;
+        ecs->queries = queries;
+        return -1;
+    }
+    ecs->map = (uint8_t*)map;
+    ecs->map_len = len;
+    if (fresh) {
+        header.map_len = len;
+        memcpy(ecs->map, &header, sizeof(header));
+    }
+    err = ecs_map_cols(ecs, &len, ecs_map_col);
+
+    // Counters come from the header, the rest is already in place
+    ecs->free_count = header.free_count;
+    ecs->active_count = header.active_count;
+    ecs->ent_count = header.ent_count;
+    for (size_t c = 0; c < MAX_CMPS; ++c) ecs->sparse[c].count = header.sparse_counts[c];
+    for (size_t c = 0; c < MAX_CMPS && !err; ++c) { // Unmapped columns still get (empty) block tables
+        ecs_col_t* ticks = &ecs->ticks[c]; // Tick blocks come from the heap, epochs as register_cmp sets them up
+        err = ecs_col_grow(&ecs->sparse[c].dense, ecs->capacity >> ECS_BLOCK_SHIFT, ecs->flags, 0)
+           || ecs_col_grow(&ecs->sparse[c].index, ecs->capacity >> ECS_BLOCK_SHIFT, ecs->flags, 0)
+           || (CHECK_BIT(ecs->tracked_cmps, c) && !(ticks->epochs = (uint32_t*)calloc(1, sizeof(uint32_t))))
+           || ecs_col_grow(ticks, ecs->capacity >> ECS_BLOCK_SHIFT, ecs->flags, 0);
+    }
+    ecs->query_count = query_count;
+    ecs->queries = queries;
+    for (size_t q = 0; q < query_count && !err; ++q) err = ecs_query_fill(ecs, queries[q]);
+    if (err) deinit_ecs(ecs);
+    return err ? -1 : 0;
+#else
+    (void)ecs; (void)filename; (void)capacity;
+    return -1;
+#endif
+}
+//// Flush a mapped world to its file, durable once this returns 0
+////   Writes between checkpoints may reach the file at any time, so a crash
+////   can leave it anywhere between two checkpoints.
+ECS_COLD int checkpoint_ecs(ecs_t* ecs) {
+#if defined(MAP_SHARED)
+    if (!(ecs->flags & ECS_MAPPED) || !ecs->map) return -1;
+    ecs_map_store(ecs);
+    return msync(ecs->map, ecs->map_len, MS_SYNC) ? -1 : 0;
+#else
+    (void)ecs;
+    return -1;
+#endif
+}
+
+// Snapshots
+//   Every world block carries the epoch of its last write. A snapshot copies
+//   only the blocks written since the previous one, the oldest snapshot in
+//   the ring is always complete, and restoring copies back only the blocks
+//   written since the target. Writes must go through the API or
+//   get_cmp_mut, writes through get_cmp pointers are not seen.
+typedef struct {
+    uint32_t col, block; // World column id (see ecs_snap_col) and block index
+    uint8_t* bytes;
+} ecs_snap_block_t;
+
+typedef struct {
+    uint32_t epoch;
+    size_t free_count, active_count, ent_count;
+    size_t sparse_counts[MAX_CMPS];
+    size_t count, cap;
+    ecs_snap_block_t* blocks; // Sorted by column, then block
+} ecs_snap_t;
+
+// Ring of delta snapshots, oldest first
+typedef struct {
+    size_t depth, first, count;
+    ecs_snap_t* ring;
+} snaps_t;
+
+#define ECS_SNAP_COLS (4 + 3 * MAX_CMPS)
+//// World column by id: entity lists first, then data, dense and index per component
+static inline ecs_col_t* ecs_snap_col(ecs_t* ecs, size_t id) {
+    switch (id) {
+        case 0: return &ecs->free_list;
+        case 1: return &ecs->active_list;
+        case 2: return &ecs->ent_slots;
+        case 3: return &ecs->ent_cmps;
+    }
+    size_t c = (id - 4) / 3;
+    return (id - 4) % 3 == 0 ? &ecs->data[c] : (id - 4) % 3 == 1 ? &ecs->sparse[c].dense : &ecs->sparse[c].index;
+}
+static inline ecs_snap_t* ecs_snap_at(snaps_t* snaps, size_t k) { return &snaps->ring[(snaps->first + k) % snaps->depth]; }
+
+//// Keep the last `depth` snapshots
+ECS_COLD int init_snapshots(snaps_t* snaps, size_t depth) {
+    memset(snaps, 0, sizeof(snaps_t));
+    if (!depth || !(snaps->ring = (ecs_snap_t*)calloc(depth, sizeof(ecs_snap_t)))) return -1;
+    snaps->depth = depth;
+    return 0;
+}
+ECS_COLD void ecs_snap_clear(ecs_snap_t* snap) {
+    for (size_t k = 0; k < snap->count; ++k) free(snap->blocks[k].bytes);
+    snap->count = 0;
+}
+//// Drop every snapshot, needed after init_ecs, load_ecs or map_ecs on the world
+ECS_COLD void clear_snapshots(snaps_t* snaps) {
+    for (size_t k = 0; k < snaps->count; ++k) ecs_snap_clear(ecs_snap_at(snaps, k));
+    snaps->first = snaps->count = 0;
+}
+ECS_COLD void free_snapshots(snaps_t* snaps) {
+    clear_snapshots(snaps);
+    for (size_t k = 0; k < snaps->depth; ++k) free(snaps->ring[k].blocks);
+    free(snaps->ring);
+    memset(snaps, 0, sizeof(snaps_t));
+}
+//// Latest copy of a block at or before snapshot k, NULL when none holds it
+static inline ecs_snap_block_t* ecs_snap_find(snaps_t* snaps, size_t k, uint32_t col, uint32_t block, uint32_t* epoch) {
+    for (size_t j = k + 1; j-- > 0;) {
+        ecs_snap_t* snap = ecs_snap_at(snaps, j);
+        size_t lo = 0, hi = snap->count;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            ecs_snap_block_t* b = &snap->blocks[mid];
+            if (b->col < col || (b->col == col && b->block < block)) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo < snap->count && snap->blocks[lo].col == col && snap->blocks[lo].block == block) {
+            *epoch = snap->epoch;
+            return &snap->blocks[lo];
+        }
+    }
+    return NULL;
+}
+ECS_COLD int ecs_snap_push(ecs_snap_t* snap, uint32_t col, uint32_t block, uint8_t* bytes) {
+    if (snap->count == snap->cap) {
+        size_t cap = snap->cap ? snap->cap * 2 : 64;
+        ecs_snap_block_t* blocks = (ecs_snap_block_t*)realloc(snap->blocks, cap * sizeof(ecs_snap_block_t));
+        if (!blocks) return -1;
+        snap->blocks = blocks;
+        snap->cap = cap;
+    }
+    snap->blocks[snap->count++] = (ecs_snap_block_t){ col, block, bytes };
+    return 0;
+}
+//// Fold the oldest snapshot into the next, so the new oldest is complete
+ECS_COLD int ecs_snap_evict(snaps_t* snaps) {
+    ecs_snap_t* old = ecs_snap_at(snaps, 0);
+    ecs_snap_t* next = ecs_snap_at(snaps, 1);
+    ecs_snap_t merged = *next;
+    merged.count = merged.cap = 0;
+    merged.blocks = NULL;
+    size_t a = 0, b = 0;
+    int err = 0;
+    while (!err && (a < old->count || b < next->count)) { // Merge sorted lists, the newer copy wins
+        ecs_snap_block_t* x = a < old->count ? &old->blocks[a] : NULL;
+        ecs_snap_block_t* y = b < next->count ? &next->blocks[b] : NULL;
+        int cmp = !x ? 1 : !y ? -1 : x->col != y->col ? (x->col < y->col ? -1 : 1) : x->block != y->block ? (x->block < y->block ? -1 : 1) : 0;
+        if (cmp == 0) { free(x->bytes); x->bytes = NULL; ++a; continue; }
+        err = cmp < 0 ? ecs_snap_push(&merged, x->col, x->block, x->bytes) : ecs_snap_push(&merged, y->col, y->block, y->bytes);
+        if (!err && cmp < 0) old->blocks[a++].bytes = NULL; else if (!err) ++b;
+    }
+    if (err) { // Leave both intact, only the new list is dropped
+        free(merged.blocks);
+        return -1;
+    }
+    free(next->blocks);
+    *next = merged;
+    old->count = 0;
+    snaps->first = (snaps->first + 1) % snaps->depth;
+    snaps->count--;
+    return 0;
+}
+//// Capture the blocks written since the previous snapshot, table and sparse worlds
+ECS_COLD int snapshot_ecs(ecs_t* ecs, snaps_t* snaps) {
+    if ((ecs->flags & (ECS_ARCHETYPES | ECS_MAPPED | ECS_FORKED)) || ANY_CMPS(ecs->pooled_cmps)) return -1; // Pool slabs carry no epochs
+    if (!ecs->ent_cmps.stride && ecs_grow(ecs, 0)) return -1;
+    if (!(ecs->flags & ECS_SNAPSHOTS)) { // Start stamping, this first snapshot takes everything
+        ecs->flags |= ECS_SNAPSHOTS;
+        ecs->epoch = 1;
+        for (size_t id = 0; id < ECS_SNAP_COLS; ++id) {
+            ecs_col_t* col = ecs_snap_col(ecs, id);
+            free(col->epochs);
+            if (!(col->epochs = (uint32_t*)calloc(col->block_count ? col->block_count : 1, sizeof(uint32_t)))) return -1;
+        }
+        clear_snapshots(snaps);
+    }
+    if (snaps->count == snaps->depth && (snaps->depth == 1 ? (clear_snapshots(snaps), 0) : ecs_snap_evict(snaps))) return -1;
+
+    ecs_snap_t* snap = ecs_snap_at(snaps, snaps->count);
+    uint32_t since = snaps->count ? ecs_snap_at(snaps, snaps->count - 1)->epoch : 0;
+    snap->epoch = ecs->epoch;
+    snap->free_count = ecs->free_count;
+    snap->active_count = ecs->active_count;
+    snap->ent_count = ecs->ent_count;
+    for (size_t c = 0; c < MAX_CMPS; ++c) snap->sparse_counts[c] = ecs->sparse[c].count;
+    for (size_t id = 0; id < ECS_SNAP_COLS; ++id) {
+        ecs_col_t* col = ecs_snap_col(ecs, id);
+        size_t bytes = col->stride << ECS_BLOCK_SHIFT;
+        for (size_t b = 0; b < col->block_count; ++b) {
+            if (!col->blocks[b] || (snaps->count && col->epochs[b] <= since)) continue;
+            uint8_t* copy = (uint8_t*)malloc(bytes);
+            if (!copy || ecs_snap_push(snap, (uint32_t)id, (uint32_t)b, copy)) {
+                free(copy);
+                ecs_snap_clear(snap);
+                return -1;
+            }
+            memcpy(copy, col->blocks[b], bytes);
+        }
+    }
+    snaps->count++;
+    ecs->epoch++; // Later writes land after this snapshot
+    return 0;
+}
+//// Roll the world back to a snapshot, `back` 0 being the latest, newer ones are dropped
+ECS_COLD int restore_ecs(ecs_t* ecs, snaps_t* snaps, size_t back) {
+    if (!(ecs->flags & ECS_SNAPSHOTS) || back >= snaps->count) return -1;
+    size_t k = snaps->count - 1 - back;
+    ecs_snap_t* snap = ecs_snap_at(snaps, k);
+    size_t stamp_count = 0, stamp_cap = 0;
+    uint32_t* stamps = NULL; // Restored blocks of tracked components, as id and block pairs
+    int err = 0;
+    for (size_t id = 0; id < ECS_SNAP_COLS; ++id) {
+        ecs_col_t* col = ecs_snap_col(ecs, id);
+        size_t bytes = col->stride << ECS_BLOCK_SHIFT;
+        int tracked = id >= 4 && (id - 4) % 3 == 0 && CHECK_BIT(ecs->tracked_cmps, (id - 4) / 3);
+        for (size_t b = 0; b < col->block_count; ++b) {
+            if (col->epochs[b] <= snap->epoch || !col->blocks[b]) continue; // Unchanged since the snapshot
+            uint32_t epoch = 0;
+            ecs_snap_block_t* copy = ecs_snap_find(snaps, k, (uint32_t)id, (uint32_t)b, &epoch);
+            if (copy) memcpy(col->blocks[b], copy->bytes, bytes);
+            else memset(col->blocks[b], 0, bytes); // Did not exist yet
+            col->epochs[b] = epoch; // Content is as of that snapshot
+            if (!tracked) continue;
+            if (stamp_count == stamp_cap) {
+                size_t cap = stamp_cap ? stamp_cap * 2 : 64;
+                uint32_t* grown = (uint32_t*)realloc(stamps, cap * 2 * sizeof(uint32_t));
+                if (!grown) { err = -1; continue; } // The world is restored, only change ticks are missed
+                stamps = grown;
+                stamp_cap = cap;
+            }
+            stamps[stamp_count * 2] = (uint32_t)(id - 4) / 3;
+            stamps[stamp_count * 2 + 1] = (uint32_t)b;
+            stamp_count++;
+        }
+    }
+    ecs->free_count = snap->free_count;
+    ecs->active_count = snap->active_count;
+    ecs->ent_count = snap->ent_count;
+    for (size_t c = 0; c < MAX_CMPS; ++c) ecs->sparse[c].count = snap->sparse_counts[c];
+    while (snaps->count > k + 1) ecs_snap_clear(ecs_snap_at(snaps, --snaps->count));
+    ecs->epoch = snap->epoch + 1;
+
+    for (size_t q = 0; q < ecs->query_count; ++q) err |= ecs_query_fill(ecs, ecs->queries[q]);
+    for (size_t s = 0; s < stamp_count; ++s) { // Rolled back values count as added for change detection
+        cmp_t c = (cmp_t)stamps[s * 2];
+        size_t start = (size_t)stamps[s * 2 + 1] << ECS_BLOCK_SHIFT;
+        int sparse = CHECK_BIT(ecs->sparse_cmps, c);
+        size_t end = sparse ? ecs->sparse[c].count : ecs->ent_count;
+        for (size_t p = start; p < end && p < start + ECS_BLOCK_ENTS; ++p) {
+            size_t i = sparse ? ENT_INDEX(ECS_REF(ent_t, &ecs->sparse[c].dense, p)) : p;
+            if (CHECK_BIT(ECS_REF(cmps_t, &ecs->ent_cmps, i), c)) ecs_tick_stamp(ecs, i, c, 1);
+        }
+    }
+    free(stamps);
+    return err ? -1 : 0;
+}
+
+// Forks
+//   A fork shares every block of its world and copies a block the first
+//   time it writes it, so forking copies only the block tables and a
+//   speculative branch pays for the blocks it touches. The world must not
+//   change while a fork of it is alive. join_ecs commits a fork into its
+//   world, deinit_ecs discards it. Like snapshots, writes must go through
+//   the API, get_cmp_mut or batch views: a write through a get_cmp pointer
+//   lands in the world's block.
+#define ECS_FORK_COLS (ECS_SNAP_COLS + MAX_CMPS)
+//// World column by id, the snapshot columns then the tick columns
+static inline ecs_col_t* ecs_fork_col(ecs_t* ecs, size_t id) {
+    return id < ECS_SNAP_COLS ? ecs_snap_col(ecs, id) : &ecs->ticks[id - ECS_SNAP_COLS];
+}
+//// Fork a table or sparse world, `fork` is overwritten and starts without queries
+ECS_COLD int fork_ecs(ecs_t* ecs, ecs_t* fork) {
+    if (ecs == fork || (ecs->flags & (ECS_ARCHETYPES | ECS_MAPPED)) || ANY_CMPS(ecs->pooled_cmps)) return -1;
+    if (!ecs->ent_cmps.stride && ecs_grow(ecs, 0)) return -1;
+    memcpy(fork, ecs, sizeof(ecs_t));
+    fork->flags = (ecs->flags & ~ECS_SNAPSHOTS) | ECS_FORKED;
+    fork->forked_from = ecs;
+    fork->query_count = 0;
+    fork->queries = NULL;
+    for (size_t id = 0; id < ECS_FORK_COLS; ++id) { // Nothing is the fork's until its tables exist
+        ecs_col_t* col = ecs_fork_col(fork, id);
+        col->blocks = NULL;
+        col->epochs = NULL;
+        col->borrowed = NULL;
+        col->block_count = 0;
+    }
+    for (size_t id = 0; id < ECS_FORK_COLS; ++id) {
+        ecs_col_t* from = ecs_fork_col(ecs, id);
+        ecs_col_t* col = ecs_fork_col(fork, id);
+        size_t words = (from->block_count + 63) >> 6;
+        col->blocks = (uint8_t**)malloc((from->block_count ? from->block_count : 1) * sizeof(uint8_t*));
+        col->borrowed = (uint64_t*)calloc(words ? words : 1, sizeof(uint64_t));
+        int ticks = id >= ECS_SNAP_COLS && from->epochs; // Tick columns keep their epochs, the rest drop them
+        if (ticks) col->epochs = (uint32_t*)malloc((from->block_count ? from->block_count : 1) * sizeof(uint32_t));
+        if (!col->blocks || !col->borrowed || (ticks && !col->epochs)) {
+            deinit_ecs(fork);
+            return -1;
+        }
+        for (size_t b = 0; b < from->block_count; ++b) {
+            col->blocks[b] = from->blocks[b];
+            if (from->blocks[b]) col->borrowed[b >> 6] |= 1ULL << (b & 63);
+        }
+        if (ticks) memcpy(col->epochs, from->epochs, from->block_count * sizeof(uint32_t));
+        col->block_count = from->block_count;
+    }
+    return 0;
+}
+//// Commit a fork into the world it was forked from, the fork is left empty
+////   Blocks the fork copied replace the world's, and the world's queries are
+////   refilled. Other forks of the world are stale afterwards.
+ECS_COLD int join_ecs(ecs_t* ecs, ecs_t* fork) {
+    if (!(fork->flags & ECS_FORKED) || fork->forked_from != ecs) return -1;
+    for (size_t id = 0; id < ECS_FORK_COLS; ++id) { // The only step that can fail
+        if (ecs_col_grow(ecs_fork_col(ecs, id), ecs_fork_col(fork, id)->block_count, ecs->flags, 0)) return -1;
+    }
+    for (size_t id = 0; id < ECS_FORK_COLS; ++id) {
+        ecs_col_t* col = ecs_fork_col(ecs, id);
+        ecs_col_t* from = ecs_fork_col(fork, id);
+        for (size_t b = 0; b < from->block_count; ++b) {
+            if (ECS_BORROWED(from, b)) continue; // Still the world's own block
+            if (!ECS_BORROWED(col, b)) ecs_block_free(col->blocks[b], col->stride << ECS_BLOCK_SHIFT, ecs->flags);
+            col->blocks[b] = from->blocks[b];
+            if (col->borrowed) col->borrowed[b >> 6] &= ~(1ULL << (b & 63));
+            if (col->epochs && id < ECS_SNAP_COLS) col->epochs[b] = ecs->epoch; // Snapshots see the change
+        }
+        if (id >= ECS_SNAP_COLS && from->epochs) { // Ticks as the fork left them
+            free(col->epochs);
+            col->epochs = from->epochs;
+            from->epochs = NULL;
+        }
+        col->stride = from->stride;
+        col->lane = from->lane;
+        free(from->blocks);
+        free(from->borrowed);
+        from->blocks = NULL;
+        from->borrowed = NULL;
+        from->block_count = 0;
+    }
+    ecs->capacity = fork->capacity;
+    ecs->free_count = fork->free_count;
+    ecs->active_count = fork->active_count;
+    ecs->ent_count = fork->ent_count;
+    memcpy(ecs->cmp_info, fork->cmp_info, sizeof(ecs->cmp_info));
+    ecs->sparse_cmps = fork->sparse_cmps;
+    ecs->tag_cmps = fork->tag_cmps;
+    ecs->tracked_cmps = fork->tracked_cmps;
+    ecs->tick = fork->tick;
+    for (size_t c = 0; c < MAX_CMPS; ++c) ecs->sparse[c].count = fork->sparse[c].count;
+    deinit_ecs(fork);
+
+    int err = 0;
+    for (size_t q = 0; q < ecs->query_count; ++q) err |= ecs_query_fill(ecs, ecs->queries[q]);
+    return err ? -1 : 0;
+}
+
+// Defragmentation
+//   Churn scatters live entities over the index space: the free list hands
+//   indices out LIFO and destroy_ent swap-removes from the active list.
+//   A pass moves the highest live entities into the lowest free slots and
+//   trims the index space, optionally sorts entities by mask and key, then
+//   rewrites the active list in index order, at most `budget` moves per
+//   call. A moved entity gets a new handle and its old one goes stale, so
+//   each call lists what it renamed for remap_ent. Trimmed slots keep their
+//   generation, create_ent and create_ents carry on from it.
+#define ECS_DEFRAG_MASK (1u << 0) // Sort entities with the same component mask together
+
+enum { ECS_DEFRAG_START, ECS_DEFRAG_COMPACT, ECS_DEFRAG_PLAN, ECS_DEFRAG_SORT, ECS_DEFRAG_LIST };
+
+// Sort key of an entity, smaller keys get lower indices
+typedef uint64_t (*defrag_key_t)(ecs_t*, ent_t, void*);
+
+// Handle renamed by a defragmentation step
+typedef struct {
+    ent_t from, to;
+} remap_t;
+
+// Planned position of an entity
+typedef struct {
+    uint64_t group, key;
+    ent_t ent;
+} ecs_defrag_rec_t;
+
+// Incremental defragmentation, one pass spans as many defrag_ecs calls as it needs
+typedef struct {
+    uint32_t flags;
+    defrag_key_t key;          // Sort key, NULL for none
+    void* data;                // Passed to key
+    uint32_t phase;
+    size_t next;               // Free list position of the next hole, then planned or active list position
+    size_t hi;                 // Highest index that may be live, while compacting
+    size_t count, cap;         // Renames of the last call, sorted by old handle
+    remap_t* moves;
+    size_t order_count;
+    ecs_defrag_rec_t* order;   // Planned order, by index
+    size_t slot_cap;
+    uint32_t* ranks;           // Entity index -> planned position
+    uint32_t* entries;         // Entity index -> rename + 1 in this call
+} defrag_t;
+
+// Setup
+//// Order by mask with ECS_DEFRAG_MASK, then by key when given, else only compact
+ECS_COLD void init_defrag(defrag_t* df, uint32_t flags, defrag_key_t key, void* data) {
+    memset(df, 0, sizeof(defrag_t));
+    df->flags = flags;
+    df->key = key;
+    df->data = data;
+}
+//// Release a pass, a new one can start with init_defrag
+ECS_COLD void free_defrag(defrag_t* df) {
+    free(df->moves);
+    free(df->order);
+    free(df->ranks);
+    free(df->entries);
+    memset(df, 0, sizeof(defrag_t));
+}
+//// Current handle of an entity renamed by the last defrag_ecs call, other handles come back as they are
+static inline ent_t remap_ent(const defrag_t* df, ent_t ent) {
+    size_t lo = 0, hi = df->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (df->moves[mid].from < ent) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < df->count && df->moves[lo].from == ent ? df->moves[lo].to : ent;
+}
+
+// Moves
+//// Swap what entity index i (live) and j (live or free) hold, the entities get new handles
+////   Out of memory changes nothing. Tracked components of moved entities
+////   read as changed, so update_spatial re-indexes them.
+ECS_COLD int ecs_ent_swap(ecs_t* ecs, size_t i, size_t j, ent_t* to_i, ent_t* to_j) {
+    ecs_slot_t si = ECS_REF(ecs_slot_t, &ecs->ent_slots, i), sj = ECS_REF(ecs_slot_t, &ecs->ent_slots, j);
+    int live = sj.pos != ECS_DEAD;
+    cmps_t mi = ECS_REF(cmps_t, &ecs->ent_cmps, i), mj = live ? ECS_REF(cmps_t, &ecs->ent_cmps, j) : ECS_NO_CMPS;
+    ent_t a = MAKE_ENT(i, si.gen), b = MAKE_ENT(j, sj.gen);
+    uint32_t gi = (si.gen + 1) % ECS_GEN_MASK, gj = live ? (sj.gen + 1) % ECS_GEN_MASK : sj.gen; // Old handles go stale
+    ent_t na = MAKE_ENT(j, gj), nb = MAKE_ENT(i, gi);
+    cmps_t table = (ecs->flags & ECS_ARCHETYPES) ? ECS_NO_CMPS : (mi | mj) & ~ecs->sparse_cmps & ~ecs->tag_cmps;
+
+    for (cmps_t m = table; ANY_CMPS(m); ECS_POP_CMP(m)) { // Every block first, the only step that can fail
+        ecs_col_t* col = &ecs->data[ECS_LOW_CMP(m)];
+        if (ecs_col_touch(col, i, ecs->flags) || ecs_col_touch(col, j, ecs->flags)) return -1;
+    }
+    for (cmps_t m = (mi | mj) & ecs->sparse_cmps; ANY_CMPS(m); ECS_POP_CMP(m)) {
+        ecs_col_t* index = &ecs->sparse[ECS_LOW_CMP(m)].index;
+        if (ecs_col_touch(index, i, ecs->flags) || ecs_col_touch(index, j, ecs->flags)) return -1;
+    }
+    for (size_t q = 0; q < ecs->query_count; ++q) {
+        query_t* query = ecs->queries[q];
+        if (!CHECK_CMPS(mi, query->cmps) && !(live && CHECK_CMPS(mj, query->cmps))) continue;
+        if (ecs_col_touch(&query->index, i, ecs->flags) || ecs_col_touch(&query->index, j, ecs->flags)) return -1;
+    }
+
+    for (cmps_t m = table; ANY_CMPS(m); ECS_POP_CMP(m)) {
+        cmp_t c = ECS_LOW_CMP(m);
+        ecs_col_t* col = &ecs->data[c];
+        if (CHECK_BIT(mi, c) && CHECK_BIT(mj, c)) ecs_col_swap(col, i, j);
+        else if (CHECK_BIT(mi, c)) ecs_col_copy(col, j, col, i);
+        else ecs_col_copy(col, i, col, j);
+        ECS_DIRTY(ecs, col, i);
+        ECS_DIRTY(ecs, col, j);
+    }
+    for (cmps_t m = (mi | mj) & ecs->sparse_cmps; ANY_CMPS(m); ECS_POP_CMP(m)) {
+        cmp_t c = ECS_LOW_CMP(m);
+        ecs_sparse_t* set = &ecs->sparse[c];
+        uint32_t pa = ECS_REF(uint32_t, &set->index, i), pb = ECS_REF(uint32_t, &set->index, j);
+        if (CHECK_BIT(mi, c)) {
+            ECS_REF(ent_t, &set->dense, pa) = na;
+            ECS_REF(uint32_t, &set->index, j) = pa;
+            ECS_DIRTY(ecs, &set->dense, pa);
+            ECS_DIRTY(ecs, &set->index, j);
+        }
+        if (CHECK_BIT(mj, c)) {
+            ECS_REF(ent_t, &set->dense, pb) = nb;
+            ECS_REF(uint32_t, &set->index, i) = pb;
+            ECS_DIRTY(ecs, &set->dense, pb);
+            ECS_DIRTY(ecs, &set->index, i);
+        }
+    }
+    if (ecs->flags & ECS_ARCHETYPES) { // Rows stay, only their owners change
+        ecs_rec_t ra = ECS_REF(ecs_rec_t, &ecs->ent_recs, i), rb = ECS_REF(ecs_rec_t, &ecs->ent_recs, j);
+        ECS_REF(ent_t, &ecs->archs[ra.arch].ents, ra.row) = na;
+        ECS_REF(ecs_rec_t, &ecs->ent_recs, j) = ra;
+        if (live) {
+            ECS_REF(ent_t, &ecs->archs[rb.arch].ents, rb.row) = nb;
+            ECS_REF(ecs_rec_t, &ecs->ent_recs, i) = rb;
+        }
+    }
+    for (size_t q = 0; q < ecs->query_count; ++q) {
+        query_t* query = ecs->queries[q];
+        if (!CHECK_CMPS(mi, query->cmps) && !(live && CHECK_CMPS(mj, query->cmps))) continue;
+        uint32_t pa = ECS_REF(uint32_t, &query->index, i), pb = ECS_REF(uint32_t, &query->index, j);
+        int has_a = CHECK_CMPS(mi, query->cmps) && pa < query->count && ECS_REF(ent_t, &query->ents, pa) == a;
+        int has_b = live && CHECK_CMPS(mj, query->cmps) && pb < query->count && ECS_REF(ent_t, &query->ents, pb) == b;
+        if (has_a) {
+            ECS_REF(ent_t, &query->ents, pa) = na;
+            ECS_REF(uint32_t, &query->index, j) = pa;
+        }
+        if (has_b) {
+            ECS_REF(ent_t, &query->ents, pb) = nb;
+            ECS_REF(uint32_t, &query->index, i) = pb;
+        }
+    }
+    for (cmps_t m = (mi | mj) & ecs->tracked_cmps; ANY_CMPS(m); ECS_POP_CMP(m)) { // Added ticks move, changed ticks are now
+        cmp_t c = ECS_LOW_CMP(m);
+        ecs_col_t* col = &ecs->ticks[c];
+        uint32_t added_a = ecs_tick_get(ecs, i, c).added, added_b = ecs_tick_get(ecs, j, c).added;
+        if (CHECK_BIT(mi, c)) {
+            ecs_tick_stamp(ecs, j, c, 0);
+            if (col->blocks[j >> ECS_BLOCK_SHIFT]) ECS_REF(ecs_tick_t, col, j).added = added_a;
+        }
+        if (CHECK_BIT(mj, c)) {
+            ecs_tick_stamp(ecs, i, c, 0);
+            if (col->blocks[i >> ECS_BLOCK_SHIFT]) ECS_REF(ecs_tick_t, col, i).added = added_b;
+        }
+    }
+
+    ECS_REF(cmps_t, &ecs->ent_cmps, j) = mi;
+    ECS_REF(cmps_t, &ecs->ent_cmps, i) = mj;
+    ECS_REF(ent_t, &ecs->active_list, si.pos) = na;
+    if (live) ECS_REF(ent_t, &ecs->active_list, sj.pos) = nb;
+    ECS_REF(ecs_slot_t, &ecs->ent_slots, j) = (ecs_slot_t){ gj, si.pos };
+    ECS_REF(ecs_slot_t, &ecs->ent_slots, i) = (ecs_slot_t){ gi, live ? sj.pos : ECS_DEAD };
+    ECS_DIRTY(ecs, &ecs->ent_cmps, i);
+    ECS_DIRTY(ecs, &ecs->ent_cmps, j);
+    ECS_DIRTY(ecs, &ecs->active_list, si.pos);
+    if (live) ECS_DIRTY(ecs, &ecs->active_list, sj.pos);
+    ECS_DIRTY(ecs, &ecs->ent_slots, i);
+    ECS_DIRTY(ecs, &ecs->ent_slots, j);
+    *to_i = na;
+    if (to_j) *to_j = nb;
+    return 0;
+}
+//// Grow the per-index tables to n entity indices
+ECS_COLD int ecs_defrag_slots(defrag_t* df, size_t n) {
+    if (n <= df->slot_cap) return 0;
+    uint32_t* ranks = (uint32_t*)realloc(df->ranks, n * sizeof(uint32_t));
+    if (ranks) df->ranks = ranks;
+    uint32_t* entries = (uint32_t*)realloc(df->entries, n * sizeof(uint32_t));
+    if (entries) df->entries = entries;
+    if (!ranks || !entries) return -1;
+    memset(df->ranks + df->slot_cap, 0xFF, (n - df->slot_cap) * sizeof(uint32_t));
+    memset(df->entries + df->slot_cap, 0, (n - df->slot_cap) * sizeof(uint32_t));
+    df->slot_cap = n;
+    return 0;
+}
+//// Room for two more renames, before the swap that makes them
+ECS_COLD int ecs_defrag_reserve(defrag_t* df) {
+    if (df->count + 2 <= df->cap) return 0;
+    size_t cap = df->cap ? df->cap * 2 : 64;
+    remap_t* moves = (remap_t*)realloc(df->moves, cap * sizeof(remap_t));
+    if (!moves) return -1;
+    df->moves = moves;
+    df->cap = cap;
+    return 0;
+}
+//// Record a rename, an entity moved twice in one call keeps one entry
+////   Returns the entry for df->entries at the new index, stored once every
+////   rename of the swap is recorded.
+static inline uint32_t ecs_defrag_note(defrag_t* df, ent_t from, ent_t to) {
+    size_t k = df->entries[ENT_INDEX(from)];
+    if (k && k <= df->count && df->moves[k - 1].to == from) df->moves[k - 1].to = to;
+    else {
+        df->moves[df->count++] = (remap_t){ from, to };
+        k = df->count;
+    }
+    return (uint32_t)k;
+}
+ECS_COLD int ecs_ent_cmp_desc(const void* a, const void* b) {
+    ent_t x = *(const ent_t*)a, y = *(const ent_t*)b;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+ECS_COLD int ecs_defrag_rec_cmp(const void* a, const void* b) {
+    const ecs_defrag_rec_t* x = (const ecs_defrag_rec_t*)a;
+    const ecs_defrag_rec_t* y = (const ecs_defrag_rec_t*)b;
+    if (x->group != y->group) return x->group < y->group ? -1 : 1;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return ENT_INDEX(x->ent) < ENT_INDEX(y->ent) ? -1 : ENT_INDEX(x->ent) > ENT_INDEX(y->ent);
+}
+ECS_COLD int ecs_remap_cmp(const void* a, const void* b) {
+    ent_t x = ((const remap_t*)a)->from, y = ((const remap_t*)b)->from;
+    return x < y ? -1 : x > y;
+}
+
+// Phases
+//// Begin a pass, holes are taken lowest first from a free list sorted high to low
+ECS_COLD int ecs_defrag_start(ecs_t* ecs, defrag_t* df) {
+    if (ecs->free_count) {
+        ent_t* holes = (ent_t*)malloc(ecs->free_count * sizeof(ent_t));
+        if (!holes) return -1;
+        for (size_t k = 0; k < ecs->free_count; ++k) holes[k] = ECS_REF(ent_t, &ecs->free_list, k);
+        qsort(holes, ecs->free_count, sizeof(ent_t), ecs_ent_cmp_desc);
+        for (size_t k = 0; k < ecs->free_count; ++k) {
+            ECS_REF(ent_t, &ecs->free_list, k) = holes[k];
+            ECS_DIRTY(ecs, &ecs->free_list, k);
+        }
+        free(holes);
+    }
+    df->next = ecs->free_count - 1; // SIZE_MAX when there is none
+    df->hi = ecs->ent_count ? ecs->ent_count - 1 : 0;
+    df->phase = ECS_DEFRAG_COMPACT;
+    return 0;
+}
+//// Drop the free slots past the last live entity, every live entity being below them
+////   The slots keep their generations, so handles to what lived there stay stale.
+ECS_COLD void ecs_defrag_trim(ecs_t* ecs) {
+    ecs->free_count = 0;
+    ecs->ent_count = ecs->active_count;
+}
+//// Plan the order of every live entity, by mask then key then index
+ECS_COLD int ecs_defrag_plan(ecs_t* ecs, defrag_t* df) {
+    size_t n = ecs->active_count;
+    ecs_defrag_rec_t* order = (ecs_defrag_rec_t*)realloc(df->order, (n ? n : 1) * sizeof(ecs_defrag_rec_t));
+    if (!order) return -1;
+    df->order = order;
+    for (size_t k = 0; k < n; ++k) {
+        ent_t ent = ECS_REF(ent_t, &ecs->active_list, k);
+        uint64_t group = 0;
+        if (df->flags & ECS_DEFRAG_MASK) {
+#if ECS_MASK_BITS == 64
+            group = ECS_REF(cmps_t, &ecs->ent_cmps, ENT_INDEX(ent));
+#else
+            group = ecs_mask_hash(ECS_REF(cmps_t, &ecs->ent_cmps, ENT_INDEX(ent))); // Equal masks stay together
+#endif
+        }
+        order[k] = (ecs_defrag_rec_t){ group, df->key ? df->key(ecs, ent, df->data) : 0, ent };
+    }
+    qsort(order, n, sizeof(ecs_defrag_rec_t), ecs_defrag_rec_cmp);
+    for (size_t p = 0; p < n; ++p) df->ranks[ENT_INDEX(order[p].ent)] = (uint32_t)p;
+    df->order_count = n;
+    df->next = 0;
+    df->phase = ECS_DEFRAG_SORT;
     return 0;
 }
 
+// Steps
+//// Advance the pass by at most `budget` entity moves, returns 1 once it completes
+////   Each unit of budget also covers ECS_BLOCK_ENTS slots looked at without
+////   a move. Starting a pass sorts the free list, ordering sorts the live
+////   entities once and completing it refills cached queries, all outside
+////   the budget. Renames are listed in
+////   df->moves until the next call, flush command buffers and patch
+////   external handles (match lists, cached ids) with remap_ent. Changes to
+////   the world between calls are fine, a stale plan just starts over.
+ECS_COLD int defrag_ecs(ecs_t* ecs, defrag_t* df, size_t budget) {
+    if (ecs->flags & ECS_FORKED) return -1;
+    if (!ecs->ent_cmps.stride && ecs_grow(ecs, 0)) return -1;
+    if (ecs_defrag_slots(df, ecs->ent_count)) return -1;
+    df->count = 0;
+    size_t scans = budget << ECS_BLOCK_SHIFT;
+    int done = 0, restarted = 0, err = 0;
+    while (budget && scans && !done && !err) {
+        if (df->phase == ECS_DEFRAG_START) {
+            err = ecs_defrag_start(ecs, df);
+        } else if (df->phase == ECS_DEFRAG_COMPACT) { // Highest live entity into the lowest hole
+            if (df->hi >= ecs->ent_count) df->hi = ecs->ent_count ? ecs->ent_count - 1 : 0;
+            for (; df->hi > 0 && scans && ECS_REF(ecs_slot_t, &ecs->ent_slots, df->hi).pos == ECS_DEAD; --scans) --df->hi;
+            if (!scans) break;
+            int top = ecs->ent_count && ECS_REF(ecs_slot_t, &ecs->ent_slots, df->hi).pos != ECS_DEAD;
+            size_t hole = df->next < ecs->free_count ? ECS_REF(ent_t, &ecs->free_list, df->next) : SIZE_MAX;
+            if (!top || hole == SIZE_MAX || hole > df->hi) { // Nothing left below the top
+                if (ecs->active_count != (top ? df->hi + 1 : 0)) { // Holes left by changes since the pass began
+                    if (restarted++) break;
+                    df->phase = ECS_DEFRAG_START;
+                    continue;
+                }
+                ecs_defrag_trim(ecs);
+                df->phase = (df->flags & ECS_DEFRAG_MASK) || df->key ? ECS_DEFRAG_PLAN : ECS_DEFRAG_LIST;
+                df->next = 0;
+                continue;
+            }
+            if (ECS_REF(ecs_slot_t, &ecs->ent_slots, hole).pos != ECS_DEAD) { // Reused since the pass began
+                if (restarted++) break;
+                df->phase = ECS_DEFRAG_START;
+                continue;
+            }
+            ent_t from = MAKE_ENT(df->hi, ECS_REF(ecs_slot_t, &ecs->ent_slots, df->hi).gen), to;
+            if (ecs_defrag_reserve(df) || ecs_ent_swap(ecs, df->hi, hole, &to, NULL)) { err = -1; break; }
+            df->entries[hole] = ecs_defrag_note(df, from, to);
+            ECS_REF(ent_t, &ecs->free_list, df->next) = (ent_t)df->hi; // The vacated slot takes the hole's place
+            ECS_DIRTY(ecs, &ecs->free_list, df->next);
+            df->next--;
+            budget--;
+        } else if (df->phase == ECS_DEFRAG_PLAN) {
+            err = ecs_defrag_plan(ecs, df);
+        } else if (df->phase == ECS_DEFRAG_SORT) { // Planned entity p into index p, swapping out whoever is there
+            size_t p = df->next;
+            if (p >= df->order_count) {
+                df->phase = ECS_DEFRAG_LIST;
+                df->next = 0;
+                continue;
+            }
+            df->next++;
+            --scans;
+            ent_t ent = df->order[p].ent;
+            if (!is_alive(ecs, ent) || ENT_INDEX(ent) == p || p >= ecs->ent_count ||
+                ECS_REF(ecs_slot_t, &ecs->ent_slots, p).pos == ECS_DEAD) continue; // In place, or gone since planned
+            size_t i = ENT_INDEX(ent);
+            ent_t other = MAKE_ENT(p, ECS_REF(ecs_slot_t, &ecs->ent_slots, p).gen), to, other_to;
+            if (ecs_defrag_reserve(df) || ecs_ent_swap(ecs, i, p, &to, &other_to)) { err = -1; break; }
+            uint32_t entry = ecs_defrag_note(df, ent, to);
+            df->entries[i] = ecs_defrag_note(df, other, other_to);
+            df->entries[p] = entry;
+            df->order[p].ent = to;
+            size_t r = df->ranks[p];
+            if (r < df->order_count && df->order[r].ent == other) { // Still to be placed, follow it
+                df->order[r].ent = other_to;
+                df->ranks[i] = (uint32_t)r;
+            }
+            budget -= budget < 2 ? budget : 2;
+        } else { // Active list in index order, a block per unit of budget
+            if (ecs->free_count || ecs->ent_count != ecs->active_count) { // Holes since, start over
+                if (restarted++) break;
+                df->phase = ECS_DEFRAG_START;
+                continue;
+            }
+            size_t end = (df->next | ECS_BLOCK_MASK) + 1 < ecs->active_count ? (df->next | ECS_BLOCK_MASK) + 1 : ecs->active_count;
+            for (size_t k = df->next; k < end; ++k) { // Entity k swaps in from further down, the list stays whole between calls
+                ecs_slot_t* slot = &ECS_REF(ecs_slot_t, &ecs->ent_slots, k);
+                size_t pos = slot->pos;
+                if (pos == k) continue;
+                ent_t other = ECS_REF(ent_t, &ecs->active_list, k);
+                ECS_REF(ent_t, &ecs->active_list, pos) = other;
+                ECS_REF(ecs_slot_t, &ecs->ent_slots, ENT_INDEX(other)).pos = (uint32_t)pos;
+                ECS_REF(ent_t, &ecs->active_list, k) = MAKE_ENT(k, slot->gen);
+                slot->pos = (uint32_t)k;
+                ECS_DIRTY(ecs, &ecs->active_list, k);
+                ECS_DIRTY(ecs, &ecs->active_list, pos);
+                ECS_DIRTY(ecs, &ecs->ent_slots, k);
+                ECS_DIRTY(ecs, &ecs->ent_slots, ENT_INDEX(other));
+            }
+            df->next = end;
+            budget--;
+            if (end >= ecs->active_count) { // Cached queries follow, in index order
+                for (size_t q = 0; q < ecs->query_count; ++q) err |= ecs_query_fill(ecs, ecs->queries[q]);
+                df->phase = ECS_DEFRAG_START;
+                done = 1;
+            }
+        }
+    }
+    if (df->count) qsort(df->moves, df->count, sizeof(remap_t), ecs_remap_cmp);
+    return err ? -1 : done;
+}
+
+/* Spatial index */
+// Loose uniform grid over a position component
+//   Every entity sits in the one cell holding its center and queries widen
+//   their search by the largest radius seen. Cells live in a hash table, so
+//   the grid is unbounded and costs memory only where entities are.
+//   update_spatial re-cells only the entities whose position changed since
+//   the tick given to the last update, through the component's change ticks,
+//   and entities that died or lost the component are unlinked when a query
+//   meets them. It never advances the world tick itself.
+#define ECS_NO_FIELD ((size_t)-1)
+#define ECS_CELL_FREE (ECS_DEAD - 1) // Unused cell table slot, ECS_DEAD heads are empty cells
+#define ECS_CELL_LIMIT (1 << 30)     // Cell coordinates are clamped to +-this
+
+// Indexed entity, by entity index
+typedef struct {
+    float pos[3];
+    float radius;
+    ent_t ent;
+    uint32_t cell;       // Slot in the cell table, ECS_DEAD when not indexed
+    uint32_t prev, next; // Entity indices within the cell, ECS_DEAD at the ends
+} ecs_spatial_item_t;
+
+typedef struct {
+    int32_t x, y, z;
+    uint32_t head; // First entity index, ECS_DEAD when empty, ECS_CELL_FREE when unused
+} ecs_cell_t;
+
+// Pair of entities whose bounds overlap
+typedef struct {
+    ent_t a, b;
+} pair_t;
+
+// Growable list of pairs, reusable across frames
+typedef struct {
+    size_t count;
+    size_t cap;
+    pair_t* pairs;
+} pairs_t;
+
+typedef struct {
+    cmp_t cmp;            // Tracked component holding the position
+    size_t pos_offset;    // Byte offset of three floats x, y, z
+    size_t radius_offset; // Byte offset of a radius float, or ECS_NO_FIELD
+    float radius;         // Radius when there is no field, added to it otherwise
+    float cell, inv_cell; // Cell edge, about twice the usual radius works best
+    float max_radius;     // Largest radius indexed, only ever grows
+    uint32_t since;       // Tick of the last update
+    ecs_col_t items;      // Entity -> ecs_spatial_item_t
+    size_t cell_count;    // Used slots, empty cells included
+    size_t cell_cap;      // Power of two
+    ecs_cell_t* cells;
+    match_t changed;      // Scratch for update_spatial
+} spatial_t;
+
+// Setup
+//// Index entities by a tracked component, the first update_spatial adds them all
+ECS_COLD int init_spatial(spatial_t* sp, ecs_t* ecs, cmp_t cmp_id, size_t pos_offset, size_t radius_offset, float radius, float cell) {
+    memset(sp, 0, sizeof(spatial_t));
+    if (cmp_id >= MAX_CMPS || !CHECK_BIT(ecs->tracked_cmps, cmp_id) || CHECK_BIT(ecs->pooled_cmps, cmp_id) || !(cell > 0) || !(radius >= 0) ||
+        pos_offset + 3 * sizeof(float) > ecs->cmp_info[cmp_id].size ||
+        (radius_offset != ECS_NO_FIELD && radius_offset + sizeof(float) > ecs->cmp_info[cmp_id].size)) return -1;
+    sp->cmp = cmp_id;
+    sp->pos_offset = pos_offset;
+    sp->radius_offset = radius_offset;
+    sp->radius = radius;
+    sp->cell = cell;
+    sp->inv_cell = 1.0f / cell;
+    sp->items.stride = sizeof(ecs_spatial_item_t);
+    sp->cell_cap = 64;
+    if (!(sp->cells = (ecs_cell_t*)malloc(sp->cell_cap * sizeof(ecs_cell_t)))) return -1;
+    for (size_t s = 0; s < sp->cell_cap; ++s) sp->cells[s].head = ECS_CELL_FREE;
+    return 0;
+}
+//// Release an index
+ECS_COLD void free_spatial(spatial_t* sp) {
+    ecs_col_free(&sp->items, 0);
+    free(sp->cells);
+    free_match(&sp->changed);
+    memset(sp, 0, sizeof(spatial_t));
+}
+//// Release a pair list
+ECS_COLD void free_pairs(pairs_t* pairs) {
+    free(pairs->pairs);
+    memset(pairs, 0, sizeof(pairs_t));
+}
+
+// Cells
+//// Cell coordinate of a position, floored and clamped
+static inline int32_t ecs_cell_coord(const spatial_t* sp, float v) {
+    float f = v * sp->inv_cell;
+    if (!(f > -ECS_CELL_LIMIT)) return -ECS_CELL_LIMIT; // NaN lands here too
+    if (f > ECS_CELL_LIMIT) return ECS_CELL_LIMIT;
+    int32_t c = (int32_t)f;
+    return c - (f < (float)c);
+}
+static inline size_t ecs_cell_hash(const spatial_t* sp, int32_t x, int32_t y, int32_t z) {
+    uint64_t key = ((uint64_t)(uint32_t)x * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)(uint32_t)y * 0xC2B2AE3D27D4EB4FULL) ^ ((uint64_t)(uint32_t)z * 0x165667B19E3779F9ULL);
+    return (size_t)(key ^ (key >> 29)) & (sp->cell_cap - 1);
+}
+//// Slot of a cell, ECS_DEAD when absent
+static inline uint32_t ecs_cell_find(const spatial_t* sp, int32_t x, int32_t y, int32_t z) {
+    for (size_t s = ecs_cell_hash(sp, x, y, z);; s = (s + 1) & (sp->cell_cap - 1)) {
+        const ecs_cell_t* cell = &sp->cells[s];
+        if (cell->head == ECS_CELL_FREE) return ECS_DEAD;
+        if (cell->x == x && cell->y == y && cell->z == z) return (uint32_t)s;
+    }
+}
+//// Rebuild the cell table at a new size, dropping empty cells
+ECS_COLD int ecs_cell_rehash(spatial_t* sp, size_t cap) {
+    ecs_cell_t* old = sp->cells;
+    size_t old_cap = sp->cell_cap;
+    if (!(sp->cells = (ecs_cell_t*)malloc(cap * sizeof(ecs_cell_t)))) {
+        sp->cells = old;
+        return -1;
+    }
+    sp->cell_cap = cap;
+    sp->cell_count = 0;
+    for (size_t s = 0; s < cap; ++s) sp->cells[s].head = ECS_CELL_FREE;
+    for (size_t s = 0; s < old_cap; ++s) {
+        if (old[s].head == ECS_CELL_FREE || old[s].head == ECS_DEAD) continue;
+        size_t t = ecs_cell_hash(sp, old[s].x, old[s].y, old[s].z);
+        while (sp->cells[t].head != ECS_CELL_FREE) t = (t + 1) & (cap - 1);
+        sp->cells[t] = old[s];
+        sp->cell_count++;
+        for (uint32_t i = old[s].head; i != ECS_DEAD; i = ECS_REF(ecs_spatial_item_t, &sp->items, i).next) {
+            ECS_REF(ecs_spatial_item_t, &sp->items, i).cell = (uint32_t)t;
+        }
+    }
+    free(old);
+    return 0;
+}
+//// Slot of a cell, created when absent, ECS_DEAD when out of memory
+ECS_COLD uint32_t ecs_cell_insert(spatial_t* sp, int32_t x, int32_t y, int32_t z) {
+    uint32_t slot = ecs_cell_find(sp, x, y, z);
+    if (slot != ECS_DEAD) return slot;
+    if ((sp->cell_count + 1) * 2 > sp->cell_cap) { // Half full, grow unless mostly empty cells
+        size_t live = 0;
+        for (size_t s = 0; s < sp->cell_cap; ++s) live += sp->cells[s].head < ECS_CELL_FREE;
+        if (ecs_cell_rehash(sp, (live + 1) * 4 > sp->cell_cap ? sp->cell_cap * 2 : sp->cell_cap)) return ECS_DEAD;
+    }
+    size_t s = ecs_cell_hash(sp, x, y, z);
+    while (sp->cells[s].head != ECS_CELL_FREE) s = (s + 1) & (sp->cell_cap - 1);
+    sp->cells[s] = (ecs_cell_t){ x, y, z, ECS_DEAD };
+    sp->cell_count++;
+    return (uint32_t)s;
+}
+//// Take an entity index out of its cell
+static inline void ecs_spatial_unlink(spatial_t* sp, uint32_t i) {
+    ecs_spatial_item_t* item = &ECS_REF(ecs_spatial_item_t, &sp->items, i);
+    if (item->prev != ECS_DEAD) ECS_REF(ecs_spatial_item_t, &sp->items, item->prev).next = item->next;
+    else sp->cells[item->cell].head = item->next;
+    if (item->next != ECS_DEAD) ECS_REF(ecs_spatial_item_t, &sp->items, item->next).prev = item->prev;
+    item->cell = ECS_DEAD;
+}
+//// Whether an indexed entity still has the component, unlinking it when not
+static inline int ecs_spatial_live(spatial_t* sp, ecs_t* ecs, uint32_t i) {
+    ent_t ent = ECS_REF(ecs_spatial_item_t, &sp->items, i).ent;
+    if (is_alive(ecs, ent) && CHECK_BIT(get_cmps(ecs, ent), sp->cmp)) return 1;
+    ecs_spatial_unlink(sp, i);
+    return 0;
+}
+
+// Update
+//// Re-cell the entities whose position changed since the last update
+////   tick is the last one the caller closed, usually from tick_ecs, and is
+////   where the next update starts. Writes after it are seen again then.
+ECS_COLD int update_spatial(spatial_t* sp, ecs_t* ecs, uint32_t tick) {
+    if (match_changed(ecs, ECS_NO_CMPS, sp->cmp, sp->since, &sp->changed) ||
+        ecs_col_grow(&sp->items, ecs->capacity >> ECS_BLOCK_SHIFT, 0, 0)) return -1;
+    for (size_t k = 0; k < sp->changed.count; ++k) {
+        ent_t ent = sp->changed.ents[k];
+        uint32_t i = (uint32_t)ENT_INDEX(ent);
+        uint8_t** block = &sp->items.blocks[i >> ECS_BLOCK_SHIFT];
+        if (!*block) { // Fresh blocks index nothing
+            if (!(*block = ecs_block_alloc(sp->items.stride << ECS_BLOCK_SHIFT, 0))) return -1;
+            for (size_t r = 0; r < ECS_BLOCK_ENTS; ++r) ((ecs_spatial_item_t*)*block)[r].cell = ECS_DEAD;
+        }
+        size_t at;
+        ecs_col_t* col = ecs_cmp_col(ecs, ent, sp->cmp, &at); // Any layout, fields may be split
+        ecs_spatial_item_t* item = &ECS_REF(ecs_spatial_item_t, &sp->items, i);
+        ecs_col_read(col, at, sp->pos_offset, item->pos, sizeof(item->pos));
+        item->radius = sp->radius;
+        if (sp->radius_offset != ECS_NO_FIELD) {
+            float r;
+            ecs_col_read(col, at, sp->radius_offset, &r, sizeof(r));
+            item->radius += r > 0 ? r : 0;
+        }
+        if (item->radius > sp->max_radius) sp->max_radius = item->radius;
+        item->ent = ent;
+
+        int32_t x = ecs_cell_coord(sp, item->pos[0]), y = ecs_cell_coord(sp, item->pos[1]), z = ecs_cell_coord(sp, item->pos[2]);
+        if (item->cell != ECS_DEAD) {
+            const ecs_cell_t* cell = &sp->cells[item->cell];
+            if (cell->x == x && cell->y == y && cell->z == z) continue; // Moved within its cell
+            ecs_spatial_unlink(sp, i);
+        }
+        uint32_t slot = ecs_cell_insert(sp, x, y, z);
+        if (slot == ECS_DEAD) return -1;
+        item = &ECS_REF(ecs_spatial_item_t, &sp->items, i);
+        item->cell = slot;
+        item->prev = ECS_DEAD;
+        item->next = sp->cells[slot].head;
+        if (item->next != ECS_DEAD) ECS_REF(ecs_spatial_item_t, &sp->items, item->next).prev = i;
+        sp->cells[slot].head = i;
+    }
+    if (tick > sp->since) sp->since = tick;
+    return 0;
+}
+
+// Queries
+//   Results are as of the last update_spatial, every entity is tested by
+//   the box around its sphere, center plus and minus its radius.
+//// Append to a match list
+static inline int ecs_match_push(match_t* match, ent_t ent) {
+    if (match->count == match->cap) {
+        size_t cap = match->cap ? match->cap * 2 : 64;
+        ent_t* ents = (ent_t*)realloc(match->ents, cap * sizeof(ent_t));
+        if (!ents) return -1;
+        match->ents = ents;
+        match->cap = cap;
+    }
+    match->ents[match->count++] = ent;
+    return 0;
+}
+//// Entities of one cell whose box overlaps [min, max]
+static inline int ecs_cell_range(spatial_t* sp, ecs_t* ecs, uint32_t slot, const float min[3], const float max[3], match_t* match) {
+    for (uint32_t i = sp->cells[slot].head, next; i != ECS_DEAD; i = next) {
+        const ecs_spatial_item_t* item = &ECS_REF(ecs_spatial_item_t, &sp->items, i);
+        next = item->next;
+        float r = item->radius;
+        if (item->pos[0] + r < min[0] || item->pos[0] - r > max[0] ||
+            item->pos[1] + r < min[1] || item->pos[1] - r > max[1] ||
+            item->pos[2] + r < min[2] || item->pos[2] - r > max[2]) continue;
+        if (ecs_spatial_live(sp, ecs, i) && ecs_match_push(match, item->ent)) return -1;
+    }
+    return 0;
+}
+//// Fill a match list with the entities overlapping the box [min, max]
+ECS_COLD int spatial_range(spatial_t* sp, ecs_t* ecs, const float min[3], const float max[3], match_t* match) {
+    match->cmps = ECS_BIT(sp->cmp);
+    match->count = 0;
+    float r = sp->max_radius;
+    int32_t lo[3], hi[3];
+    double span = 1;
+    for (int a = 0; a < 3; ++a) {
+        lo[a] = ecs_cell_coord(sp, min[a] - r);
+        hi[a] = ecs_cell_coord(sp, max[a] + r);
+        if (lo[a] > hi[a]) return 0;
+        span *= (double)hi[a] - lo[a] + 1;
+    }
+    if (span <= (double)sp->cell_count) { // Small box, look its cells up
+        for (int32_t x = lo[0]; x <= hi[0]; ++x) for (int32_t y = lo[1]; y <= hi[1]; ++y) for (int32_t z = lo[2]; z <= hi[2]; ++z) {
+            uint32_t slot = ecs_cell_find(sp, x, y, z);
+            if (slot != ECS_DEAD && ecs_cell_range(sp, ecs, slot, min, max, match)) return -1;
+        }
+        return 0;
+    }
+    for (size_t s = 0; s < sp->cell_cap; ++s) { // Large box, walk the occupied cells instead
+        const ecs_cell_t* cell = &sp->cells[s];
+        if (cell->head >= ECS_CELL_FREE || cell->x < lo[0] || cell->x > hi[0] ||
+            cell->y < lo[1] || cell->y > hi[1] || cell->z < lo[2] || cell->z > hi[2]) continue;
+        if (ecs_cell_range(sp, ecs, (uint32_t)s, min, max, match)) return -1;
+    }
+    return 0;
+}
+//// Whether a cube, by center and half edge, is wholly outside one of the planes
+static inline int ecs_planes_cull(const float planes[][4], size_t plane_count, const float center[3], float half) {
+    for (size_t p = 0; p < plane_count; ++p) { // Signed distance against the cube's extent along the normal
+        const float* n = planes[p];
+        float extent = half * ((n[0] < 0 ? -n[0] : n[0]) + (n[1] < 0 ? -n[1] : n[1]) + (n[2] < 0 ? -n[2] : n[2]));
+        if (n[0] * center[0] + n[1] * center[1] + n[2] * center[2] + n[3] < -extent) return 1;
+    }
+    return 0;
+}
+//// Fill a match list with the entities inside every plane, ax + by + cz + d >= 0
+////   Six planes with inward normals make a view frustum. Cells are culled
+////   first, widened by the largest radius, then the entities they hold.
+ECS_COLD int spatial_frustum(spatial_t* sp, ecs_t* ecs, const float planes[][4], size_t plane_count, match_t* match) {
+    match->cmps = ECS_BIT(sp->cmp);
+    match->count = 0;
+    float r = sp->max_radius, half = sp->cell * 0.5f;
+    for (size_t s = 0; s < sp->cell_cap; ++s) {
+        const ecs_cell_t* cell = &sp->cells[s];
+        if (cell->head >= ECS_CELL_FREE) continue;
+        float center[3] = { ((float)cell->x + 0.5f) * sp->cell, ((float)cell->y + 0.5f) * sp->cell, ((float)cell->z + 0.5f) * sp->cell };
+        if (ecs_planes_cull(planes, plane_count, center, half + r)) continue;
+        for (uint32_t i = cell->head, next; i != ECS_DEAD; i = next) {
+            const ecs_spatial_item_t* item = &ECS_REF(ecs_spatial_item_t, &sp->items, i);
+            next = item->next;
+            if (ecs_planes_cull(planes, plane_count, item->pos, item->radius)) continue;
+            if (ecs_spatial_live(sp, ecs, i) && ecs_match_push(match, item->ent)) return -1;
+        }
+    }
+    return 0;
+}
+//// Append a pair when two indexed entities overlap
+static inline int ecs_pair_test(spatial_t* sp, pairs_t* pairs, uint32_t i, uint32_t j) {
+    const ecs_spatial_item_t* a = &ECS_REF(ecs_spatial_item_t, &sp->items, i);
+    const ecs_spatial_item_t* b = &ECS_REF(ecs_spatial_item_t, &sp->items, j);
+    float r = a->radius + b->radius;
+    float dx = a->pos[0] - b->pos[0], dy = a->pos[1] - b->pos[1], dz = a->pos[2] - b->pos[2];
+    if (dx > r || -dx > r || dy > r || -dy > r || dz > r || -dz > r) return 0;
+    if (pairs->count == pairs->cap) {
+        size_t cap = pairs->cap ? pairs->cap * 2 : 64;
+        pair_t* grown = (pair_t*)realloc(pairs->pairs, cap * sizeof(pair_t));
+        if (!grown) return -1;
+        pairs->pairs = grown;
+        pairs->cap = cap;
+    }
+    pairs->pairs[pairs->count++] = (pair_t){ a->ent, b->ent };
+    return 0;
+}
+//// Fill a pair list with every two entities whose boxes overlap, each pair once
+////   Each cell is tested against itself and the forward half of its
+////   neighbours, as far as the largest radius can reach.
+ECS_COLD int spatial_pairs(spatial_t* sp, ecs_t* ecs, pairs_t* pairs) {
+    pairs->count = 0;
+    for (size_t s = 0; s < sp->cell_cap; ++s) { // Unlink the dead first, so the pair loops need no checks
+        for (uint32_t i = sp->cells[s].head, next; i < ECS_CELL_FREE; i = next) {
+            next = ECS_REF(ecs_spatial_item_t, &sp->items, i).next;
+            ecs_spatial_live(sp, ecs, i);
+        }
+    }
+    int32_t reach = 1 + (int32_t)(2.0f * sp->max_radius * sp->inv_cell);
+    for (size_t s = 0; s < sp->cell_cap; ++s) {
+        const ecs_cell_t* cell = &sp->cells[s];
+        if (cell->head >= ECS_CELL_FREE) continue;
+        for (uint32_t i = cell->head; i != ECS_DEAD; i = ECS_REF(ecs_spatial_item_t, &sp->items, i).next) {
+            for (uint32_t j = ECS_REF(ecs_spatial_item_t, &sp->items, i).next; j != ECS_DEAD; j = ECS_REF(ecs_spatial_item_t, &sp->items, j).next) {
+                if (ecs_pair_test(sp, pairs, i, j)) return -1;
+            }
+        }
+        for (int32_t dx = 0; dx <= reach; ++dx) for (int32_t dy = dx ? -reach : 0; dy <= reach; ++dy) for (int32_t dz = dx || dy ? -reach : 1; dz <= reach; ++dz) {
+            uint32_t other = ecs_cell_find(sp, cell->x + dx, cell->y + dy, cell->z + dz);
+            if (other == ECS_DEAD || sp->cells[other].head == ECS_DEAD) continue;
+            for (uint32_t i = cell->head; i != ECS_DEAD; i = ECS_REF(ecs_spatial_item_t, &sp->items, i).next) {
+                for (uint32_t j = sp->cells[other].head; j != ECS_DEAD; j = ECS_REF(ecs_spatial_item_t, &sp->items, j).next) {
+                    if (ecs_pair_test(sp, pairs, i, j)) return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
 
 #endif // ECS_H
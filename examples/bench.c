@@ -0,0 +1,493 @@
+// Benchmarks, every operation at 1k to 1M entities
+//   cc -O2 -march=native -o bench bench.c && ./bench [max entities] [-c]
+//   Each row is the median and p99 time per entity over repeated runs, and
+//   the median of a whole run. -c adds hardware counters per entity through
+//   perf_event_open, where the kernel allows it.
+
+#define _GNU_SOURCE // syscall
+#include "../ecs.h"
+#include <stdio.h>
+#include <time.h>
+#include <string.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define MAX_REPS 201
+#define REP_BUDGET 20000000 // Entity operations per row, bounds the repetitions at large scales
+
+enum { CMP_POS, CMP_VEL, CMP_TAG, CMP_COUNT };
+
+typedef struct { float x, y, z; } pos_t;
+typedef struct { float dx, dy, dz; } vel_t;
+
+/**** Measurement ****/
+/******************************************************************************/
+enum { CTR_CYCLES, CTR_INSTRUCTIONS, CTR_CACHE_MISSES, CTR_BRANCH_MISSES, CTR_COUNT };
+
+typedef struct {
+    size_t reps;
+    size_t count;
+    double samples[MAX_REPS]; // Nanoseconds per run
+    struct timespec start;
+    int fds[CTR_COUNT];       // -1 when counters are off or refused
+    uint64_t counters[CTR_COUNT];
+} bench_t;
+
+static int use_counters = 0;
+
+static void counters_open(bench_t* b) {
+    for (int c = 0; c < CTR_COUNT; ++c) b->fds[c] = -1;
+#if defined(__linux__)
+    if (!use_counters) return;
+    static const uint64_t configs[CTR_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    for (int c = 0; c < CTR_COUNT; ++c) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[c];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        b->fds[c] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+}
+
+static void counters_close(bench_t* b) {
+#if defined(__linux__)
+    for (int c = 0; c < CTR_COUNT; ++c) if (b->fds[c] >= 0) close(b->fds[c]);
+#endif
+}
+
+static void bench_init(bench_t* b, size_t n) {
+    memset(b, 0, sizeof(bench_t));
+    b->reps = REP_BUDGET / n;
+    if (b->reps < 11) b->reps = 11;
+    if (b->reps > MAX_REPS) b->reps = MAX_REPS;
+    counters_open(b);
+}
+
+static inline void bench_begin(bench_t* b) {
+#if defined(__linux__)
+    for (int c = 0; c < CTR_COUNT; ++c) if (b->fds[c] >= 0) { ioctl(b->fds[c], PERF_EVENT_IOC_RESET, 0); ioctl(b->fds[c], PERF_EVENT_IOC_ENABLE, 0); }
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &b->start);
+}
+
+static inline void bench_end(bench_t* b) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+#if defined(__linux__)
+    for (int c = 0; c < CTR_COUNT; ++c) {
+        uint64_t value = 0;
+        if (b->fds[c] < 0) continue;
+        ioctl(b->fds[c], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(b->fds[c], &value, sizeof(value)) == sizeof(value)) b->counters[c] += value;
+    }
+#endif
+    b->samples[b->count++] = (end.tv_sec - b->start.tv_sec) * 1e9 + (end.tv_nsec - b->start.tv_nsec);
+}
+
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Median and p99 (nearest rank) per entity, then counters averaged per entity
+static void bench_report(bench_t* b, const char* name, size_t n) {
+    qsort(b->samples, b->count, sizeof(double), cmp_double);
+    double median = b->samples[b->count / 2];
+    double p99 = b->samples[(b->count * 99 + 99) / 100 - 1];
+    printf("  %-22s %9.2f %9.2f %12.1f", name, median / (double)n, p99 / (double)n, median / 1e3);
+    for (int c = 0; c < CTR_COUNT; ++c) {
+        if (b->fds[c] >= 0) printf(" %9.2f", (double)b->counters[c] / (double)(b->count * n));
+        else if (use_counters) printf(" %9s", "n/a");
+    }
+    printf("\n");
+    counters_close(b);
+}
+
+/**** Worlds ****/
+/******************************************************************************/
+static void world_init(ecs_t* ecs, uint32_t flags, uint32_t cmp_flags) {
+    memset(ecs, 0, sizeof(ecs_t)); // Zeroed, so table worlds grow on first use
+    if (flags) init_ecs(ecs, 0, flags);
+    REGISTER_CMP(ecs, CMP_POS, pos_t, cmp_flags);
+    REGISTER_CMP(ecs, CMP_VEL, vel_t, cmp_flags);
+    REGISTER_CMP(ecs, CMP_TAG, int, ECS_CMP_SPARSE);
+}
+
+// n entities with a position and velocity, every tenth tagged
+static void world_fill(ecs_t* ecs, size_t n, uint32_t flags, uint32_t cmp_flags) {
+    world_init(ecs, flags, cmp_flags);
+    for (size_t i = 0; i < n; ++i) {
+        ent_t ent = create_ent(ecs);
+        pos_t pos = { (float)i, 0.0f, 0.0f };
+        vel_t vel = { 1.0f, 0.5f, 0.25f };
+        add_cmp(ecs, ent, CMP_POS, &pos, sizeof(pos));
+        add_cmp(ecs, ent, CMP_VEL, &vel, sizeof(vel));
+        if (i % 10 == 0) add_cmp(ecs, ent, CMP_TAG, &i, sizeof(int));
+    }
+}
+
+// Destroy half at random and create as many again, a third of them without a velocity
+static void world_churn(ecs_t* ecs, size_t n) {
+    uint32_t seed = 12345;
+    for (size_t k = 0; k < n / 2; ++k) {
+        seed = seed * 1664525u + 1013904223u;
+        destroy_ent(ecs, ECS_REF(ent_t, &ecs->active_list, (seed >> 8) % ecs->active_count));
+    }
+    for (size_t k = 0; k < n / 2; ++k) {
+        ent_t ent = create_ent(ecs);
+        pos_t pos = { (float)k, 1.0f, 0.0f };
+        vel_t vel = { 0.5f, 0.5f, 0.5f };
+        add_cmp(ecs, ent, CMP_POS, &pos, sizeof(pos));
+        if (k % 3) add_cmp(ecs, ent, CMP_VEL, &vel, sizeof(vel));
+    }
+}
+
+static inline void system_move(ecs_t* ecs, ent_t ent, void* data) {
+    (void)data;
+    pos_t* pos = (pos_t*)get_cmp(ecs, ent, CMP_POS);
+    vel_t* vel = (vel_t*)get_cmp(ecs, ent, CMP_VEL);
+    pos->x += vel->dx;
+    pos->y += vel->dy;
+    pos->z += vel->dz;
+}
+
+static void batch_move(ecs_t* ecs, view_t* view, void* data) {
+    (void)ecs; (void)data;
+    pos_t* pos = VIEW_CMP(view, pos_t, CMP_POS);
+    vel_t* vel = VIEW_CMP(view, vel_t, CMP_VEL);
+    for (size_t i = 0; i < view->count; ++i) {
+        pos[i].x += vel[i].dx;
+        pos[i].y += vel[i].dy;
+        pos[i].z += vel[i].dz;
+    }
+}
+
+static void batch_move_split(ecs_t* ecs, view_t* view, void* data) {
+    (void)ecs; (void)data;
+    float* x = VIEW_FIELD(view, pos_t, CMP_POS, x);
+    float* y = VIEW_FIELD(view, pos_t, CMP_POS, y);
+    float* z = VIEW_FIELD(view, pos_t, CMP_POS, z);
+    const float* dx = VIEW_FIELD(view, vel_t, CMP_VEL, dx);
+    const float* dy = VIEW_FIELD(view, vel_t, CMP_VEL, dy);
+    const float* dz = VIEW_FIELD(view, vel_t, CMP_VEL, dz);
+    for (size_t i = 0; i < view->count; ++i) {
+        x[i] += dx[i];
+        y[i] += dy[i];
+        z[i] += dz[i];
+    }
+}
+
+// One field of each, what split layout is for
+static void batch_move_y(ecs_t* ecs, view_t* view, void* data) {
+    (void)ecs; (void)data;
+    pos_t* pos = VIEW_CMP(view, pos_t, CMP_POS);
+    vel_t* vel = VIEW_CMP(view, vel_t, CMP_VEL);
+    for (size_t i = 0; i < view->count; ++i) pos[i].y += vel[i].dy;
+}
+
+static void batch_move_y_split(ecs_t* ecs, view_t* view, void* data) {
+    (void)ecs; (void)data;
+    float* y = VIEW_FIELD(view, pos_t, CMP_POS, y);
+    const float* dy = VIEW_FIELD(view, vel_t, CMP_VEL, dy);
+    for (size_t i = 0; i < view->count; ++i) y[i] += dy[i];
+}
+
+static inline void system_tagged(ecs_t* ecs, ent_t ent, void* data) {
+    (void)data;
+    ((pos_t*)get_cmp(ecs, ent, CMP_POS))->y += 1.0f;
+}
+
+// Growable memory stream for save and load
+typedef struct {
+    uint8_t* bytes;
+    size_t size, cap, pos;
+} mem_t;
+
+static int mem_write(const void* data, size_t size, void* ctx) {
+    mem_t* mem = (mem_t*)ctx;
+    if (mem->size + size > mem->cap) {
+        size_t cap = (mem->size + size) * 2;
+        uint8_t* bytes = (uint8_t*)realloc(mem->bytes, cap);
+        if (!bytes) return -1;
+        mem->bytes = bytes;
+        mem->cap = cap;
+    }
+    memcpy(mem->bytes + mem->size, data, size);
+    mem->size += size;
+    return 0;
+}
+
+static int mem_read(void* data, size_t size, void* ctx) {
+    mem_t* mem = (mem_t*)ctx;
+    if (mem->pos + size > mem->size) return -1;
+    memcpy(data, mem->bytes + mem->pos, size);
+    mem->pos += size;
+    return 0;
+}
+
+/**** Benchmarks ****/
+/******************************************************************************/
+static void bench_scale(size_t n) {
+    bench_t b;
+    ecs_t ecs;
+    pos_t pos = { 0.0f, 0.0f, 0.0f };
+    vel_t vel = { 1.0f, 1.0f, 1.0f };
+    ent_t* ents = (ent_t*)malloc(n * sizeof(ent_t));
+    pos_t* positions = (pos_t*)calloc(n, sizeof(pos_t));
+    vel_t* velocities = (vel_t*)calloc(n, sizeof(vel_t));
+    for (size_t i = 0; i < n; ++i) velocities[i] = vel;
+
+    bench_init(&b, n);
+    printf("%zu entities, %zu runs, ns per entity\n", n, b.reps);
+    printf("  %-22s %9s %9s %12s", "", "median", "p99", "run us");
+    if (use_counters) printf(" %9s %9s %9s %9s", "cycles", "instrs", "llc miss", "br miss");
+    printf("\n");
+
+    // Structural changes, a fresh world every run
+    for (size_t r = 0; r < b.reps; ++r) {
+        world_init(&ecs, 0, 0);
+        bench_begin(&b);
+        for (size_t i = 0; i < n; ++i) ents[i] = create_ent(&ecs);
+        bench_end(&b);
+        deinit_ecs(&ecs);
+    }
+    bench_report(&b, "create", n);
+
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        world_init(&ecs, 0, 0);
+        bench_begin(&b);
+        create_ents(&ecs, n, ents);
+        bench_end(&b);
+        deinit_ecs(&ecs);
+    }
+    bench_report(&b, "create bulk", n);
+
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        world_init(&ecs, 0, 0);
+        create_ents(&ecs, n, ents);
+        bench_begin(&b);
+        for (size_t i = 0; i < n; ++i) {
+            add_cmp(&ecs, ents[i], CMP_POS, &pos, sizeof(pos));
+            add_cmp(&ecs, ents[i], CMP_VEL, &vel, sizeof(vel));
+        }
+        bench_end(&b);
+        deinit_ecs(&ecs);
+    }
+    bench_report(&b, "add 2", n);
+
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        world_init(&ecs, 0, 0);
+        create_ents(&ecs, n, ents);
+        bench_begin(&b);
+        add_cmp_bulk(&ecs, ents, n, CMP_POS, positions, sizeof(pos_t));
+        add_cmp_bulk(&ecs, ents, n, CMP_VEL, velocities, sizeof(vel_t));
+        bench_end(&b);
+        deinit_ecs(&ecs);
+    }
+    bench_report(&b, "add 2 bulk", n);
+
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        world_fill(&ecs, n, 0, 0);
+        bench_begin(&b);
+        for (size_t i = 0; i < n; ++i) destroy_ent(&ecs, MAKE_ENT(i, 0));
+        bench_end(&b);
+        deinit_ecs(&ecs);
+    }
+    bench_report(&b, "destroy", n);
+
+    // Iteration, one world for every run
+    world_fill(&ecs, n, 0, 0);
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        bench_begin(&b);
+        for (size_t i = 0; i < n; ++i) {
+            positions[i].x += velocities[i].dx;
+            positions[i].y += velocities[i].dy;
+            positions[i].z += velocities[i].dz;
+        }
+        __asm__ volatile("" : : "r"(positions) : "memory"); // Keep the loop
+        bench_end(&b);
+    }
+    bench_report(&b, "iterate direct arrays", n);
+
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        bench_begin(&b);
+        run(system_move, NULL, &ecs, cmps(2, CMP_POS, CMP_VEL));
+        bench_end(&b);
+    }
+    bench_report(&b, "iterate dense", n);
+
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        bench_begin(&b);
+        run_batch(batch_move, NULL, &ecs, cmps(2, CMP_POS, CMP_VEL));
+        bench_end(&b);
+    }
+    bench_report(&b, "iterate dense batch", n);
+
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        bench_begin(&b);
+        EACH(&ecs, ent, (pos_t, pos, CMP_POS), (vel_t, vel, CMP_VEL)) {
+            pos->x += vel->dx;
+            pos->y += vel->dy;
+            pos->z += vel->dz;
+        }
+        bench_end(&b);
+    }
+    bench_report(&b, "iterate dense each", n);
+
+    ecs_t split;
+    world_fill(&split, n, 0, ECS_CMP_SPLIT); // Same world, one float array per field
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        bench_begin(&b);
+        run_batch(batch_move_split, NULL, &split, cmps(2, CMP_POS, CMP_VEL));
+        bench_end(&b);
+    }
+    bench_report(&b, "iterate split batch", n);
+    deinit_ecs(&split);
+
+    // One field, in archetype worlds where a batch is a whole chunk and the layout is all that differs
+    ecs_t arch;
+    world_fill(&arch, n, ECS_ARCHETYPES, 0);
+    world_fill(&split, n, ECS_ARCHETYPES, ECS_CMP_SPLIT);
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        bench_begin(&b);
+        run_batch(batch_move_y, NULL, &arch, cmps(2, CMP_POS, CMP_VEL));
+        bench_end(&b);
+    }
+    bench_report(&b, "iterate field aos", n);
+
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        bench_begin(&b);
+        run_batch(batch_move_y_split, NULL, &split, cmps(2, CMP_POS, CMP_VEL));
+        bench_end(&b);
+    }
+    bench_report(&b, "iterate field split", n);
+    deinit_ecs(&arch);
+    deinit_ecs(&split);
+
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        bench_begin(&b);
+        run(system_tagged, NULL, &ecs, cmps(2, CMP_POS, CMP_TAG));
+        bench_end(&b);
+    }
+    bench_report(&b, "iterate sparse 10%", n);
+
+    query_t* query = create_query(&ecs, cmps(2, CMP_POS, CMP_VEL));
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        bench_begin(&b);
+        run_query(system_move, NULL, &ecs, query);
+        bench_end(&b);
+    }
+    bench_report(&b, "iterate query", n);
+
+    match_t match = {0};
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        bench_begin(&b);
+        match_ents(&ecs, cmps(2, CMP_POS, CMP_VEL), &match);
+        bench_end(&b);
+    }
+    bench_report(&b, "match", n);
+    free_match(&match);
+
+    mem_t mem = {0};
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        mem.size = 0;
+        bench_begin(&b);
+        save_ecs_stream(&ecs, mem_write, &mem);
+        bench_end(&b);
+    }
+    bench_report(&b, "save", n);
+
+    ecs_t loaded = {0};
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        mem.pos = 0;
+        bench_begin(&b);
+        if (load_ecs_stream(&loaded, mem_read, &mem)) fprintf(stderr, "load failed\n");
+        bench_end(&b);
+    }
+    bench_report(&b, "load", n);
+    if (loaded.active_count != ecs.active_count) fprintf(stderr, "load lost entities\n");
+    deinit_ecs(&loaded);
+    free(mem.bytes);
+
+    world_churn(&ecs, n); // Holes in the index space, a third of the newcomers do not match
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        bench_begin(&b);
+        run_batch(batch_move, NULL, &ecs, cmps(2, CMP_POS, CMP_VEL));
+        bench_end(&b);
+    }
+    bench_report(&b, "iterate churned batch", n);
+
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        bench_begin(&b);
+        run_query(system_move, NULL, &ecs, query);
+        bench_end(&b);
+    }
+    bench_report(&b, "iterate churned query", n);
+
+    defrag_t defrag; // Pack and group the churned world again, then the same loops
+    init_defrag(&defrag, ECS_DEFRAG_MASK, NULL, NULL);
+    while (!defrag_ecs(&ecs, &defrag, 256));
+    free_defrag(&defrag);
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        bench_begin(&b);
+        run_batch(batch_move, NULL, &ecs, cmps(2, CMP_POS, CMP_VEL));
+        bench_end(&b);
+    }
+    bench_report(&b, "iterate packed batch", n);
+
+    bench_init(&b, n);
+    for (size_t r = 0; r < b.reps; ++r) {
+        bench_begin(&b);
+        run_query(system_move, NULL, &ecs, query);
+        bench_end(&b);
+    }
+    bench_report(&b, "iterate packed query", n);
+    deinit_ecs(&ecs);
+
+    printf("\n");
+    free(ents);
+    free(positions);
+    free(velocities);
+}
+
+/**** Usage ****/
+/******************************************************************************/
+int main(int argc, char** argv) {
+    size_t max = 1000000;
+    for (int a = 1; a < argc; ++a) {
+        if (!strcmp(argv[a], "-c")) use_counters = 1;
+        else max = strtoull(argv[a], NULL, 10);
+    }
+    for (size_t n = 1000; n <= max; n *= 10) bench_scale(n);
+    return 0;
+}
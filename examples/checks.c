@@ -0,0 +1,187 @@
+// Self-checks for behaviour that breaks quietly, one function per case
+//   cc -O2 -o checks checks.c && ./checks
+//   Exits non-zero and names the first check that failed.
+
+#include <stdlib.h>
+
+// Every block the world allocates goes through here, so a check can run it out of memory
+static int fail_allocs;
+static void* checks_alloc(size_t align, size_t size);
+#define aligned_alloc checks_alloc
+#include "../ecs.h"
+#undef aligned_alloc
+static void* checks_alloc(size_t align, size_t size) { return fail_allocs ? NULL : aligned_alloc(align, size); }
+
+enum { CMP_POS, CMP_RARE, CMP_MARK };
+
+typedef struct { float x, y, z; } pos_t;
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __func__, __LINE__, #cond); return 1; } } while (0)
+
+static void batch_read(ecs_t* ecs, view_t* view, void* data) {
+    (void)ecs;
+    float* sum = (float*)data;
+    const pos_t* pos = VIEW_CMP(view, pos_t, CMP_POS);
+    for (size_t i = 0; i < view->count; ++i) *sum += pos[i].x;
+}
+
+// Batches and EACH over a sparse component bind one entity at a time, and only read
+static int check_mixed_read_only(uint32_t flags) {
+    ecs_t ecs;
+    CHECK(!init_ecs(&ecs, 0, flags));
+    REGISTER_CMP(&ecs, CMP_POS, pos_t, ECS_CMP_TRACKED);
+    REGISTER_CMP(&ecs, CMP_RARE, int, ECS_CMP_SPARSE | ECS_CMP_TRACKED);
+    for (int i = 0; i < 100; ++i) {
+        ent_t ent = create_ent(&ecs);
+        pos_t pos = { (float)i, 0.0f, 0.0f };
+        add_cmp(&ecs, ent, CMP_POS, &pos, sizeof(pos));
+        add_cmp(&ecs, ent, CMP_RARE, &i, sizeof(int));
+    }
+    uint32_t since = tick_ecs(&ecs);
+
+    float sum = 0.0f;
+    run_batch(batch_read, &sum, &ecs, cmps(2, CMP_POS, CMP_RARE));
+    EACH(&ecs, ent, (pos_t, pos, CMP_POS), (int, rare, CMP_RARE)) sum += pos->x + (float)*rare;
+    CHECK(sum == 2.0f * 4950.0f + 4950.0f);
+
+    match_t changed = {0};
+    CHECK(!match_changed(&ecs, ECS_NO_CMPS, CMP_POS, since, &changed));
+    CHECK(changed.count == 0);
+    CHECK(!match_changed(&ecs, ECS_NO_CMPS, CMP_RARE, since, &changed));
+    CHECK(changed.count == 0);
+    free_match(&changed);
+    deinit_ecs(&ecs);
+    return 0;
+}
+
+// EACH over a split component runs every body and keeps what it wrote, break included
+static int check_each_split(uint32_t flags, uint32_t cmp_flags) {
+    ecs_t ecs;
+    CHECK(!init_ecs(&ecs, 0, flags));
+    REGISTER_CMP(&ecs, CMP_POS, pos_t, ECS_CMP_SPLIT | cmp_flags);
+    REGISTER_CMP(&ecs, CMP_RARE, int, 0);
+    ent_t ents[3000];
+    for (int i = 0; i < 3000; ++i) {
+        ents[i] = create_ent(&ecs);
+        pos_t pos = { (float)i, 0.0f, 0.0f };
+        add_cmp(&ecs, ents[i], CMP_POS, &pos, sizeof(pos));
+    }
+
+    size_t bodies = 0;
+    EACH(&ecs, ent, (pos_t, pos, CMP_POS)) {
+        (void)ent;
+        pos->y = pos->x + 1.0f;
+        ++bodies;
+    }
+    CHECK(bodies == 3000);
+    for (int i = 0; i < 3000; ++i) CHECK(*GET_FIELD(&ecs, ents[i], pos_t, CMP_POS, y) == (float)i + 1.0f);
+
+    ent_t moved = 0;
+    EACH(&ecs, ent, (pos_t, pos, CMP_POS)) { // The copy follows its entity into another archetype
+        pos->y = -1.0f;
+        add_cmp(&ecs, ent, CMP_RARE, &bodies, sizeof(int));
+        moved = ent;
+        break;
+    }
+    CHECK(*GET_FIELD(&ecs, moved, pos_t, CMP_POS, y) == -1.0f);
+    for (int i = 0; i < 3000; ++i) CHECK(ents[i] == moved || *GET_FIELD(&ecs, ents[i], pos_t, CMP_POS, y) == (float)i + 1.0f);
+
+    bodies = 0;
+    EACH(&ecs, ent, (pos_t, pos, CMP_POS)) {
+        (void)ent;
+        pos->z = 7.0f;
+        if (++bodies == 10) break;
+    }
+    size_t written = 0;
+    for (int i = 0; i < 3000; ++i) written += *GET_FIELD(&ecs, ents[i], pos_t, CMP_POS, z) == 7.0f;
+    CHECK(bodies == 10 && written == 10);
+    deinit_ecs(&ecs);
+    return 0;
+}
+
+// A query that cannot grow fails the change instead of missing the entity
+static int check_query_out_of_memory(uint32_t flags) {
+    ecs_t ecs;
+    CHECK(!init_ecs(&ecs, 0, flags));
+    REGISTER_TAG(&ecs, CMP_MARK, 0); // No column blocks, the query index is all that allocates
+    query_t* query = create_query(&ecs, cmps(1, CMP_MARK));
+    CHECK(query);
+    ent_t first = create_ent(&ecs), far = first;
+    for (size_t i = 0; i < ECS_BLOCK_ENTS; ++i) far = create_ent(&ecs);
+    CHECK(!add_cmp(&ecs, first, CMP_MARK, NULL, 0));
+
+    fail_allocs = 1;
+    int failed = add_cmp(&ecs, far, CMP_MARK, NULL, 0);
+    fail_allocs = 0;
+    CHECK(failed && !CHECK_BIT(get_cmps(&ecs, far), CMP_MARK) && query->count == 1);
+
+    CHECK(!add_cmp(&ecs, far, CMP_MARK, NULL, 0));
+    CHECK(query->count == 2);
+    destroy_ent(&ecs, first);
+    CHECK(query->count == 1 && ECS_REF(ent_t, &query->ents, 0) == far);
+    destroy_ent(&ecs, far);
+    CHECK(query->count == 0);
+    deinit_ecs(&ecs);
+    return 0;
+}
+
+// Components an archetype entity lacks have no element to point at
+static int check_arch_missing(void) {
+    ecs_t ecs;
+    CHECK(!init_ecs(&ecs, 0, ECS_ARCHETYPES));
+    REGISTER_CMP(&ecs, CMP_POS, pos_t, 0);
+    REGISTER_CMP(&ecs, CMP_RARE, int, ECS_CMP_POOLED);
+    ent_t ent = create_ent(&ecs);
+    CHECK(!get_cmp(&ecs, ent, CMP_POS) && !GET_FIELD(&ecs, ent, pos_t, CMP_POS, y));
+    CHECK(!get_cmp(&ecs, ent, CMP_RARE) && !cmp_size(&ecs, ent, CMP_RARE));
+    pos_t pos = { 1.0f, 2.0f, 3.0f };
+    CHECK(!add_cmp(&ecs, ent, CMP_POS, &pos, sizeof(pos)));
+    CHECK(get_cmp(&ecs, ent, CMP_POS) && *GET_FIELD(&ecs, ent, pos_t, CMP_POS, y) == 2.0f);
+    CHECK(!get_cmp(&ecs, ent, CMP_RARE));
+    deinit_ecs(&ecs);
+    return 0;
+}
+
+// A mapped world keeps change detection for tracked components, across reopening too
+static int check_map_tracked(void) {
+#if defined(MAP_SHARED)
+    const char* path = "checks.ecs";
+    remove(path);
+    ecs_t ecs = {0};
+    REGISTER_CMP(&ecs, CMP_POS, pos_t, ECS_CMP_TRACKED);
+    CHECK(map_ecs(&ecs, path, 0) == -1); // A fresh file needs room for something
+    CHECK(!map_ecs(&ecs, path, 1024));
+    ent_t ent = create_ent(&ecs);
+    pos_t pos = { 1.0f, 2.0f, 3.0f };
+    CHECK(!add_cmp(&ecs, ent, CMP_POS, &pos, sizeof(pos)));
+    match_t changed = {0};
+    for (int pass = 0; pass < 2; ++pass) {
+        uint32_t since = tick_ecs(&ecs);
+        CHECK(!match_changed(&ecs, ECS_NO_CMPS, CMP_POS, since, &changed) && changed.count == 0);
+        CHECK(get_cmp_mut(&ecs, ent, CMP_POS));
+        CHECK(!match_changed(&ecs, ECS_NO_CMPS, CMP_POS, since, &changed) && changed.count == 1);
+        deinit_ecs(&ecs);
+        memset(&ecs, 0, sizeof(ecs));
+        CHECK(!map_ecs(&ecs, path, 0)); // Reopens, the registry comes from the file
+    }
+    free_match(&changed);
+    deinit_ecs(&ecs);
+    remove(path);
+#endif
+    return 0;
+}
+
+int main(void) {
+    int failed = 0;
+    failed |= check_mixed_read_only(0);
+    failed |= check_mixed_read_only(ECS_ARCHETYPES);
+    failed |= check_each_split(0, 0);
+    failed |= check_each_split(ECS_ARCHETYPES, 0);
+    failed |= check_each_split(0, ECS_CMP_SPARSE);
+    failed |= check_query_out_of_memory(0);
+    failed |= check_query_out_of_memory(ECS_ARCHETYPES);
+    failed |= check_arch_missing();
+    failed |= check_map_tracked();
+    if (!failed) printf("all checks passed\n");
+    return failed;
+}
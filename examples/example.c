@@ -4,7 +4,7 @@ typedef enum {
     CMP_ID
 } cmp_id;
 
-static inline void system(ecs_t* ecs, ent_t ent, void* context) {
+static inline void example_system(ecs_t* ecs, ent_t ent, void* context) {
     int *component = (int*)get_cmp(ecs, ent, CMP_ID);
     int *data      = (int*)context;
     *component += *data;
@@ -18,11 +18,12 @@ int main(void) {
     add_cmp(&ecs, ent, CMP_ID, &cmp_data, sizeof(cmp_data));
 
     int data = 5;
-    run(system, &data, &ecs, cmps(CMP_ID));
+    run(example_system, &data, &ecs, cmps(1, CMP_ID));
 
     int *cmp = (int*)get_cmp(&ecs, ent, CMP_ID);
     printf("Entity %d, Component %d: %d\n", ent, CMP_ID, *cmp);
 
     destroy_ent(&ecs, ent);
+    deinit_ecs(&ecs);
     return 0;
 }
@@ -1,6 +1,7 @@
 // Simple Quake-Like in 400 LOC
 
 #include "raylib.h"
+#include "raymath.h"
 #include "ecs.h"
 
 /* I find header files obfuscate implimentation
@@ -50,109 +51,82 @@ typedef struct {
 
 /**** 3D Space *******/
 /************************************************/
-typedef struct OctreeNode {
-    BoundingBox bounds;
-    struct OctreeNode* children[8];
-    int entity_count;
-    ent_t entities[MAX_ENTS];
-} OctreeNode;
-
-// Interaction functions
-OctreeNode* CreateOctreeNode(BoundingBox bounds) {
-    OctreeNode* node = (OctreeNode*)MemAlloc(sizeof(OctreeNode));
-    node->bounds = bounds;
-    memset(node->children, 0, sizeof(node->children));
-    node->entity_count = 0;
-    return node;
-}
-
-void InsertEntityInOctree(OctreeNode* node, ent_t entity, BoundingBox bounds) {
-    if (node->entity_count < MAX_ENTS) {
-        node->entities[node->entity_count++] = entity;
-    } else {
-        // Split node or insert into children (simplified logic)
-    }
-}
-
-void GetEntitiesInFrustum(OctreeNode* node, Camera camera, ent_t* visible_entities, int* visible_count) {
-    if (IsBoundingBoxInFrustum(node->bounds, camera)) {
-        for (int i = 0; i < node->entity_count; ++i) {
-            visible_entities[(*visible_count)++] = node->entities[i];
-        }
-        for (int i = 0; i < 8; ++i) {
-            if (node->children[i]) {
-                GetEntitiesInFrustum(node->children[i], camera, visible_entities, visible_count);
-            }
-        }
+// Frustum planes of a camera, facing inwards, for spatial_frustum
+void camera_frustum(Camera camera, float aspect, float planes[6][4]) {
+    Matrix proj = MatrixPerspective(camera.fovy * DEG2RAD, aspect, 0.01, 1000.0);
+    Matrix m = MatrixMultiply(GetCameraMatrix(camera), proj);
+    float rows[4][4] = {
+        { m.m0, m.m4, m.m8,  m.m12 },
+        { m.m1, m.m5, m.m9,  m.m13 },
+        { m.m2, m.m6, m.m10, m.m14 },
+        { m.m3, m.m7, m.m11, m.m15 },
+    };
+    for (int p = 0; p < 6; ++p) { // Left, right, bottom, top, near, far
+        float sign = (p & 1) ? -1.0f : 1.0f;
+        for (int k = 0; k < 4; ++k) planes[p][k] = rows[3][k] + sign * rows[p / 2][k];
     }
 }
 
-// Frustum culling
-bool IsBoundingBoxInFrustum(BoundingBox box, Camera camera) {
-    // Perform frustum culling based on the camera's view frustum
-    // Simplified placeholder implementation
-    return CheckCollisionBoxFrustum(box, GetCameraFrustum(camera));
-}
-
 /**** Game Systems *******/
 /**************************************************/
-void system_move(ecs_t* ecs, ent_t ent, void* data) {
-    cmp_transform_t* trans = (cmp_transform_t*)get_cmp(ecs, ent, 0);
-    cmp_velocity_t* vel = (cmp_velocity_t*)get_cmp(ecs, ent, 1);
-
-    trans->x += vel->dx;
-    trans->y += vel->dy;
-    trans->z += vel->dz;
+void system_move(ecs_t* ecs, view_t* view, void* data) {
+    float* x = VIEW_FIELD(view, cmp_transform_t, 0, x); // Split components, one float array per field
+    float* y = VIEW_FIELD(view, cmp_transform_t, 0, y);
+    float* z = VIEW_FIELD(view, cmp_transform_t, 0, z);
+    const float* dx = VIEW_FIELD(view, cmp_velocity_t, 1, dx);
+    const float* dy = VIEW_FIELD(view, cmp_velocity_t, 1, dy);
+    const float* dz = VIEW_FIELD(view, cmp_velocity_t, 1, dz);
+
+    for (size_t i = 0; i < view->count; ++i) { // Aligned loads at full vector width
+        x[i] += dx[i];
+        y[i] += dy[i];
+        z[i] += dz[i];
+    }
+    touch_view(ecs, view, 0); // Moved, the spatial index picks these up
 }
 
-void system_world_collision(ecs_t* ecs, ent_t ent, void* data) {
-    cmp_collision_t* col = (cmp_collision_t*)get_cmp(ecs, ent, 2);
-    cmp_transform_t* trans = (cmp_transform_t*)get_cmp(ecs, ent, 0);
-    cmp_velocity_t* vel = (cmp_velocity_t*)get_cmp(ecs, ent, 1);
-
-    // Simplified collision logic: check against other entities
-    for (size_t i = 0; i < ecs->active_count; ++i) {
-        ent_t other = ecs->active_list[i];
-        if (other == ent) continue;
-
-        if (CHECK_BIT(ecs->ent_cmps[other], 2)) {
-            cmp_collision_t* other_col = (cmp_collision_t*)get_cmp(ecs, other, 2);
-
-            // Perform collision check (bounding box, etc.)
-            if (CheckCollisionBoxes(col->bounds, other_col->bounds)) {
-                // Handle collision (e.g., stop movement, reduce health, etc.)
-                trans->x -= vel->dx; // Simple collision response
-                trans->y -= vel->dy;
-                trans->z -= vel->dz;
-            }
+void system_world_collision(ecs_t* ecs, pairs_t* contacts) {
+    // Broadphase pairs from the spatial index, only nearby entities are ever compared
+    for (size_t i = 0; i < contacts->count; ++i) {
+        ent_t pair[2] = { contacts->pairs[i].a, contacts->pairs[i].b };
+        if (!CHECK_BIT(get_cmps(ecs, pair[0]), 2) || !CHECK_BIT(get_cmps(ecs, pair[1]), 2)) continue;
+        cmp_collision_t* a = (cmp_collision_t*)get_cmp(ecs, pair[0], 2);
+        cmp_collision_t* b = (cmp_collision_t*)get_cmp(ecs, pair[1], 2);
+        if (!CheckCollisionBoxes(a->bounds, b->bounds)) continue;
+
+        for (int k = 0; k < 2; ++k) { // Handle collision (e.g., stop movement, reduce health, etc.)
+            if (!CHECK_BIT(get_cmps(ecs, pair[k]), 1)) continue; // Static
+            if (!get_cmp_mut(ecs, pair[k], 0)) continue; // Marks the move
+            *GET_FIELD(ecs, pair[k], cmp_transform_t, 0, x) -= *GET_FIELD(ecs, pair[k], cmp_velocity_t, 1, dx); // Simple collision response
+            *GET_FIELD(ecs, pair[k], cmp_transform_t, 0, y) -= *GET_FIELD(ecs, pair[k], cmp_velocity_t, 1, dy);
+            *GET_FIELD(ecs, pair[k], cmp_transform_t, 0, z) -= *GET_FIELD(ecs, pair[k], cmp_velocity_t, 1, dz);
         }
     }
 }
 
 void system_input(ecs_t* ecs, ent_t ent, void* data) {
-    cmp_velocity_t* vel = (cmp_velocity_t*)get_cmp(ecs, ent, 1);
+    float* dx = GET_FIELD(ecs, ent, cmp_velocity_t, 1, dx);
+    float* dz = GET_FIELD(ecs, ent, cmp_velocity_t, 1, dz);
 
-    if (IsKeyDown(KEY_W)) vel->dz -= 1.0f;
-    if (IsKeyDown(KEY_S)) vel->dz += 1.0f;
-    if (IsKeyDown(KEY_A)) vel->dx -= 1.0f;
-    if (IsKeyDown(KEY_D)) vel->dx += 1.0f;
+    if (IsKeyDown(KEY_W)) *dz -= 1.0f;
+    if (IsKeyDown(KEY_S)) *dz += 1.0f;
+    if (IsKeyDown(KEY_A)) *dx -= 1.0f;
+    if (IsKeyDown(KEY_D)) *dx += 1.0f;
 }
 
-void system_visibility_check(ecs_t* ecs, ent_t* visible_entities, int* visible_count, Camera* camera) {
-    OctreeNode* octree = (OctreeNode*)ecs; // Assuming the octree is stored in ecs for simplicity
-    GetEntitiesInFrustum(octree, *camera, visible_entities, visible_count);
+void system_visibility_check(ecs_t* ecs, spatial_t* space, Camera* camera, match_t* visible) {
+    float planes[6][4];
+    camera_frustum(*camera, (float)GetScreenWidth() / (float)GetScreenHeight(), planes);
+    spatial_frustum(space, ecs, planes, 6, visible); // Whole cells are culled first
+    SET_BIT(visible->cmps, 3); // run_match then skips anything without a model
 }
 
-void system_world_render(ecs_t* ecs, ent_t* visible_entities, int visible_count, Camera* camera) {
-    for (int i = 0; i < visible_count; ++i) {
-        ent_t ent = visible_entities[i];
-
-        cmp_transform_t* trans = (cmp_transform_t*)get_cmp(ecs, ent, 0);
-        cmp_renderable_t* render = (cmp_renderable_t*)get_cmp(ecs, ent, 3);
+void system_world_render(ecs_t* ecs, ent_t ent, void* data) {
+    Vector3 pos = { *GET_FIELD(ecs, ent, cmp_transform_t, 0, x), *GET_FIELD(ecs, ent, cmp_transform_t, 0, y), *GET_FIELD(ecs, ent, cmp_transform_t, 0, z) };
+    cmp_renderable_t* render = (cmp_renderable_t*)get_cmp(ecs, ent, 3);
 
-        // Render the model
-        DrawModel(render->model, (Vector3){ trans->x, trans->y, trans->z }, trans->scale, WHITE);
-    }
+    // Render the model
+    DrawModel(render->model, pos, *GET_FIELD(ecs, ent, cmp_transform_t, 0, scale), WHITE);
 }
 
 void system_lighting(ecs_t* ecs, ent_t ent, void* data) {
@@ -163,28 +137,25 @@ void system_lighting(ecs_t* ecs, ent_t ent, void* data) {
 }
 
 void system_physics(ecs_t* ecs, ent_t ent, void* data) {
-    cmp_velocity_t* vel = (cmp_velocity_t*)get_cmp(ecs, ent, 1);
-
     // Apply gravity
-    vel->dy -= 9.8f * GetFrameTime(); // Gravity acceleration
+    *GET_FIELD(ecs, ent, cmp_velocity_t, 1, dy) -= 9.8f * GetFrameTime(); // Gravity acceleration
 }
 
 void system_camera_control(ecs_t* ecs, ent_t player, Camera* camera) {
-    cmp_transform_t* trans = (cmp_transform_t*)get_cmp(ecs, player, 0);
+    float x = *GET_FIELD(ecs, player, cmp_transform_t, 0, x);
+    float y = *GET_FIELD(ecs, player, cmp_transform_t, 0, y);
+    float z = *GET_FIELD(ecs, player, cmp_transform_t, 0, z);
 
-    camera->position = (Vector3){ trans->x, trans->y + 1.8f, trans->z + 10.0f };
-    camera->target = (Vector3){ trans->x, trans->y + 1.8f, trans->z };
+    camera->position = (Vector3){ x, y + 1.8f, z + 10.0f };
+    camera->target = (Vector3){ x, y + 1.8f, z };
 }
 
 void system_ai(ecs_t* ecs, ent_t ent, void* data) {
-    cmp_transform_t* trans = (cmp_transform_t*)get_cmp(ecs, ent, 0);
-    cmp_velocity_t* vel = (cmp_velocity_t*)get_cmp(ecs, ent, 1);
-
-    cmp_transform_t* player_trans = (cmp_transform_t*)get_cmp(ecs, *((ent_t*)data), 0);
+    ent_t player = *((ent_t*)data);
 
     // Simple chase AI
-    vel->dx = player_trans->x > trans->x ? 1.0f : -1.0f;
-    vel->dz = player_trans->z > trans->z ? 1.0f : -1.0f;
+    *GET_FIELD(ecs, ent, cmp_velocity_t, 1, dx) = *GET_FIELD(ecs, player, cmp_transform_t, 0, x) > *GET_FIELD(ecs, ent, cmp_transform_t, 0, x) ? 1.0f : -1.0f;
+    *GET_FIELD(ecs, ent, cmp_velocity_t, 1, dz) = *GET_FIELD(ecs, player, cmp_transform_t, 0, z) > *GET_FIELD(ecs, ent, cmp_transform_t, 0, z) ? 1.0f : -1.0f;
 }
 
 void system_sound(ecs_t* ecs, ent_t ent, void* data) {
@@ -193,7 +164,7 @@ void system_sound(ecs_t* ecs, ent_t ent, void* data) {
     }
 }
 
-void init_world(ecs_t* ecs, OctreeNode* octree) {
+void init_world(ecs_t* ecs) {
     // Create static entities like walls, floors, etc.
     ent_t wall = create_ent(ecs);
 
@@ -207,8 +178,6 @@ void init_world(ecs_t* ecs, OctreeNode* octree) {
     add_cmp(ecs, wall, 2, &wall_collision, sizeof(wall_collision));
     add_cmp(ecs, wall, 3, &wall_renderable, sizeof(wall_renderable));
 
-    InsertEntityInOctree(octree, wall, wall_static.bounds);
-
     // Repeat for other static and dynamic objects
 }
 
@@ -284,9 +253,14 @@ int main() {
     SetTargetFPS(60);
 
     ecs_t ecs = {0}; // Initialize ECS
-    BoundingBox worldBounds = (BoundingBox){{-100.0f, -100.0f, -100.0f}, {100.0f, 100.0f, 100.0f}};
-    OctreeNode* octree = CreateOctreeNode(worldBounds); // Define world bounds here
-    init_world(&ecs, octree); // Initialize the world state
+    REGISTER_CMP(&ecs, 0, cmp_transform_t, ECS_CMP_TRACKED | ECS_CMP_SPLIT); // Drives the spatial index, stored field by field
+    REGISTER_CMP(&ecs, 1, cmp_velocity_t, ECS_CMP_SPLIT);
+    REGISTER_CMP(&ecs, 2, cmp_collision_t, 0);
+    REGISTER_CMP(&ecs, 3, cmp_renderable_t, ECS_CMP_POOLED); // Models are large, kept out of line
+    REGISTER_CMP(&ecs, 4, cmp_light_t, ECS_CMP_SPARSE); // Few lights, iterate only those
+    spatial_t space; // Entities by transform, scale is the radius, cells of 4 units
+    init_spatial(&space, &ecs, 0, offsetof(cmp_transform_t, x), offsetof(cmp_transform_t, scale), 0.0f, 4.0f);
+    init_world(&ecs); // Initialize the world state
 
     // Create a player entity
     ent_t player = create_ent(&ecs);
@@ -309,19 +283,33 @@ int main() {
 
     Sound shootSound = LoadSound("resources/shoot.wav");
 
-    ent_t visible_entities[MAX_ENTS];
-    int visible_count = 0;
+    match_t visible = {0};
+    pairs_t contacts = {0};
+
+    // Queries are matched once and kept current by the ECS
+    query_t* movers = create_query(&ecs, cmps(2, 0, 1));
+    query_t* lights = create_query(&ecs, cmps(2, 0, 4));
+
+    // Update systems, in frame order, with what each reads and writes
+    sched_t update = {0};
+    add_query_system(&update, system_input, NULL, movers, 0, cmps(1, 1));
+    add_query_system(&update, system_physics, NULL, movers, 0, cmps(1, 1));
+    add_batch_system(&update, system_move, NULL, cmps(2, 0, 1), cmps(1, 1), cmps(1, 0));
+    add_query_system(&update, system_ai, &player, movers, cmps(1, 0), cmps(1, 1));
+    add_query_system(&update, system_sound, &shootSound, movers, 0, 0);
+#if defined(ECS_THREADS)
+    workers_t pool;
+    init_workers(&pool, 4);
+    update.pool = &pool; // Non-conflicting systems run concurrently
+#endif
 
     while (!WindowShouldClose()) {
-        // Update systems
-        run(system_input, NULL, &ecs, cmps(2, 0, 1));
-        run(system_physics, NULL, &ecs, cmps(2, 0, 1));
-        run(system_move, NULL, &ecs, cmps(2, 0, 1));
-        run(system_world_collision, NULL, &ecs, cmps(3, 0, 1, 2));
-        run(system_ai, &player, &ecs, cmps(2, 0, 1));
-        run(system_sound, &shootSound, &ecs, cmps(2, 0, 1));
-        visible_count = 0;
-        run(system_visibility_check, &camera, &ecs, cmps(2, 0, 3));
+        run_sched(&update, &ecs);
+        update_spatial(&space, &ecs, tick_ecs(&ecs)); // Only what moved is re-celled
+        spatial_pairs(&space, &ecs, &contacts);
+        system_world_collision(&ecs, &contacts);
+        update_spatial(&space, &ecs, tick_ecs(&ecs)); // Collision pushed some back
+        system_visibility_check(&ecs, &space, &camera, &visible);
         run(system_camera_control, player, &camera);
 
         // Render
@@ -330,15 +318,22 @@ int main() {
 
         BeginMode3D(camera);
 
-        run(system_world_render, visible_entities, &ecs, cmps(2, 0, 3));
-        run(system_lighting, NULL, &ecs, cmps(2, 0, 4));
+        run_match(system_world_render, NULL, &ecs, &visible); // Visible renderables only
+        run_query(system_lighting, NULL, &ecs, lights);
 
         EndMode3D();
         EndDrawing();
     }
 
+#if defined(ECS_THREADS)
+    deinit_workers(&pool);
+#endif
+    free_match(&visible);
+    free_pairs(&contacts);
+    free_spatial(&space);
     UnloadSound(shootSound);
     unload_resources();
+    deinit_ecs(&ecs);
     CloseWindow(); // De-initialize the window
     return 0;
 }
@@ -0,0 +1,42 @@
+// Parallel systems defined in another translation unit, recording commands
+//   cc -O2 -pthread -o threads threads.c threads_systems.c && ./threads
+//   Exits non-zero if a command was lost or landed on the wrong entity,
+//   which is what happens when workers in other files share one buffer.
+
+#define ECS_THREADS
+#include "../ecs.h"
+
+enum { CMP_HEALTH, CMP_DAMAGE };
+
+void system_hit(ecs_t* ecs, ent_t ent, void* data); // threads_systems.c
+
+int main(void) {
+    ecs_t ecs = {0};
+    REGISTER_CMP(&ecs, CMP_HEALTH, int, 0);
+    REGISTER_CMP(&ecs, CMP_DAMAGE, int, 0);
+    for (int i = 0; i < 100000; ++i) {
+        ent_t ent = create_ent(&ecs);
+        add_cmp(&ecs, ent, CMP_HEALTH, &i, sizeof(int));
+    }
+
+    workers_t pool;
+    cmds_t cmds = {0};
+    if (init_workers(&pool, 4)) return 1;
+    int failed = 0;
+    for (int frame = 0; frame < 8 && !failed; ++frame) {
+        run_par(&pool, system_hit, &cmds, &ecs, cmps(1, CMP_HEALTH), 0); // Each worker records into its own buffer
+        flush_cmds(&cmds, &ecs);
+        for (size_t i = 0; i < ecs.active_count; ++i) {
+            ent_t ent = ECS_REF(ent_t, &ecs.active_list, i);
+            int* damage = (int*)get_cmp(&ecs, ent, CMP_DAMAGE);
+            failed |= !CHECK_BIT(get_cmps(&ecs, ent), CMP_DAMAGE) || *damage != *(int*)get_cmp(&ecs, ent, CMP_HEALTH) % 7;
+            del_cmp(&ecs, ent, CMP_DAMAGE);
+        }
+    }
+    printf("%s\n", failed ? "commands lost" : "ok");
+
+    deinit_workers(&pool);
+    free_cmds(&cmds);
+    deinit_ecs(&ecs);
+    return failed;
+}
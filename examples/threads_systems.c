@@ -0,0 +1,11 @@
+// Systems of threads.c, compiled apart to share the worker index across files
+
+#define ECS_THREADS
+#include "../ecs.h"
+
+enum { CMP_HEALTH, CMP_DAMAGE };
+
+void system_hit(ecs_t* ecs, ent_t ent, void* data) {
+    int damage = *(int*)get_cmp(ecs, ent, CMP_HEALTH) % 7;
+    cmd_add((cmds_t*)data, ent, CMP_DAMAGE, &damage, sizeof(damage)); // Lands in this worker's buffer
+}